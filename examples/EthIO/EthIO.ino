@@ -19,374 +19,1603 @@
 #include <gkutil.h>
 #include <gkutil/modulation.h>
 #include <gkutil/schedule.h>
-//#include <gkutil/listener.h>
+#include <gkutil/listener.h>
+#include <gkutil/debounce.h>
+#include <gkutil/sampler.h>
 
+// Serial data rate at startup; the host can change it with set_data_rate
 #define BAUD_RATE 115200
+// How long a new data rate waits for confirm_data_rate before going back, and
+// how far from the requested rate the UART may run, in thousandths
+#define DATA_RATE_CONFIRM_MS 250
+#define DATA_RATE_MAX_ERROR 25
 
 int serial_write_bigendian(uint8_t* value, int size);
 
-// A command dispatcher is a function taking no arguments and returning a
-// boolean true (if the command is completed) or false (if the command needs to
-// remain active)
-typedef bool CommandDispatcher(void);
+// Each command is a command byte followed by a fixed number of argument bytes,
+// which are collected and then passed to the command's handler all at once.
+// Some commands carry a series of items after their arguments (e.g. the
+// intervals of a pulse train), more than might fit in the serial receive
+// buffer at once; their handler sets command_items to the number that follow,
+// and each item is passed to the command's item handler, along with the
+// arguments, as soon as it arrives. The end handler is called after the last
+// item, with complete=false instead if the command was cut off partway (by
+// the end of its frame, in the framed protocol).
+typedef void CommandHandler(const uint8_t* args);
+typedef void CommandItemHandler(const uint8_t* args, const uint8_t* item);
+typedef void CommandEndHandler(const uint8_t* args, bool complete);
+
+typedef struct Command {
+    CommandHandler* run;
+    uint8_t length;        // bytes of arguments
+    uint8_t item_length;   // bytes per item, for commands with items
+    CommandItemHandler* item;
+    CommandEndHandler* end;
+} Command;
+
+// Longest arguments of any command (set_reflex), or arguments plus one item
+#define COMMAND_BUFFER_SIZE 15
 
 // <config_output_high> <pin>
 // Configure <pin> for output
-bool cmd_config_output();
+void cmd_config_output(const uint8_t* args);
 
 // <config_output_low> <pin>
 // Configure <pin> for inverted logic output (on=low, off=high)
-bool cmd_config_output_inverted();
+void cmd_config_output_inverted(const uint8_t* args);
 
 // <pulse> <pin> <dur1> <dur2>
 // Immediately toggle <pin>, then after word(<dur1>,<dur2>) ms, toggle it back
-bool cmd_pulse();
+void cmd_pulse(const uint8_t* args);
 
 // <pulse_train> <pin> <count> <on1> <on2> [<off1> <off2> <on1> <on2>]*
 // Immediately turn pin on, then schedule it to be turned off in word(on1,on2)
 // ms. If count>1, then schedule count-1 additional pulses, each starting
 // word(off1,off2) ms after the previous one ends and lasting for word(on1,on2)
 // ms.
-bool cmd_pulse_train();
+void cmd_pulse_train(const uint8_t* args);
+void pulse_train_interval(const uint8_t* args, const uint8_t* item);
+void pulse_train_end(const uint8_t* args, bool complete);
 
 // <pulse_after> <pin> <delay1> <delay2> <dur1> <dur2>
 // After a delay of word(<delay1>,<delay2>) ms, pulse <pin> for
 // word(<dur1>,<dur2>) ms. If any actions are already scheduled for <pin>,
 // the delay begins following the last scheduled action for that pin.
-bool cmd_pulse_after();
+void cmd_pulse_after(const uint8_t* args);
 
 // <config_input_pullup> <pin>
 // Configure <pin> for input, and activate its pullup resistor
-bool cmd_config_input_pullup();
+void cmd_config_input_pullup(const uint8_t* args);
 
 // <config_input_nopullup> <pin>
 // Configure <pin> for input, and deactivate its pullup resistor
-bool cmd_config_input_nopullup();
+void cmd_config_input_nopullup(const uint8_t* args);
 
 // <read_pin> <pin>
 // Immediately check the input value on <pin> and send it to serial output
-bool cmd_read_pin();
+void cmd_read_pin(const uint8_t* args);
 
 // <get_clock>
-// Send the current time of millis() to serial output.
-bool cmd_get_clock();
+// Send the current time of gk_time_now() to serial output.
+void cmd_get_clock(const uint8_t* args);
 
 // <get_last_clock>
 // Send the time at which the last pin write command was initiated to
 // serial output. This will correspond to the moment of the first pin value
 // toggle produced by the command (e.g., rising edge of pulse).
-bool cmd_get_last_clock();
-
-//bool cmd_start_listening();
-//bool cmd_stop_listening();
-//bool cmd_set_data_rate();
-//bool cmd_send_bytes();
-//bool cmd_send_clock();
-bool cmd_get_schedule_size();
-
-bool invert_pin_output[GK_NUM_PINS] = {false};
-
-#define PIN_ON_VALUE(pin) ( \
-    invert_pin_output[pin] ? GK_PIN_WRITE_OFF : GK_PIN_WRITE_ON \
-)
-#define PIN_OFF_VALUE(pin) ( \
-    invert_pin_output[pin] ? GK_PIN_WRITE_ON : GK_PIN_WRITE_OFF \
-)
-
-CommandDispatcher*const dispatchers[] = {
-    NULL,
-    cmd_config_output,
-    cmd_config_output_inverted,
-    cmd_pulse,
-    cmd_pulse_train,
-    cmd_pulse_after,
-    cmd_config_input_pullup,
-    cmd_config_input_nopullup,
-    cmd_read_pin,
-    cmd_get_clock,
-    cmd_get_last_clock,
-//    cmd_start_listening,
-//    cmd_stop_listening,
-//    cmd_set_data_rate,
-//    cmd_send_bytes,
-//    cmd_send_clock,
-    cmd_get_schedule_size,
+void cmd_get_last_clock(const uint8_t* args);
+
+//void cmd_send_clock(const uint8_t* args);
+void cmd_get_schedule_size(const uint8_t* args);
+
+// <get_tick_period>
+// Send the length of one unit of the device clock, in nanoseconds, to serial
+// output.
+void cmd_get_tick_period(const uint8_t* args);
+
+// <cancel_pin> <pin>
+// Remove all scheduled actions on <pin>, and return it to its resting state
+void cmd_cancel_pin(const uint8_t* args);
+
+// <get_pin_schedule_size> <pin>
+// Send the number of actions currently scheduled on <pin> to serial output
+void cmd_get_pin_schedule_size(const uint8_t* args);
+
+// <start_listening> <pin>
+// Begin reporting changes of input <pin> to the host. Sends 1 to serial output
+// if the pin can be listened to, or 0 if not. While any pins are being
+// listened to, all serial output is tagged; see report_edges.
+void cmd_start_listening(const uint8_t* args);
+
+// <stop_listening> <pin>
+// Stop reporting changes of input <pin> to the host. Sends 1 to serial output
+// if the pin was being listened to, or 0 if not. This response is still
+// tagged if any pins were being listened to before the command.
+void cmd_stop_listening(const uint8_t* args);
+
+// <enable_framing>
+// Switch to the framed protocol (see below) until the next reset. Sends
+// FRAMING_VERSION to serial output, as the last output of the raw protocol.
+void cmd_enable_framing(const uint8_t* args);
+
+// <sync>
+// Exchange clock readings with the host, so that it can relate the device
+// clock to its own. Sends the number of fine clock units per clock unit
+// (2 bytes; see gk_time_fine), then the fine clock when the command was
+// received and when this response was written, then the device clock at the
+// same two moments (4 bytes each), to serial output. The fine clock wraps
+// around much sooner than the device clock, so the host needs both.
+void cmd_sync(const uint8_t* args);
+
+// Absolute-time commands schedule their writes at a given time on the device
+// clock, rather than relative to when the command arrives, so that they are
+// unaffected by serial latency. Each sends a status to serial output:
+// SCHEDULE_OK if everything was scheduled, SCHEDULE_LATE if the time had
+// already passed, SCHEDULE_NO_ROOM if the schedule didn't have room for all
+// of it, or SCHEDULE_INVALID if the arguments made no sense. Nothing is
+// scheduled unless the status is SCHEDULE_OK.
+#define SCHEDULE_OK 0
+#define SCHEDULE_LATE 1
+#define SCHEDULE_NO_ROOM 2
+#define SCHEDULE_INVALID 3
+
+// <write_at> <pin> <on> <time1> <time2> <time3> <time4>
+// Schedule <pin> to be turned on (if <on> is nonzero) or off at <time>.
+void cmd_write_at(const uint8_t* args);
+
+// <pulse_at> <pin> <time1> <time2> <time3> <time4> <dur1> <dur2>
+// Schedule a pulse on <pin> that begins at <time> and lasts <dur> ms.
+void cmd_pulse_at(const uint8_t* args);
+
+// <pulse_train_at> <pin> <time1> <time2> <time3> <time4> <num_pulses>
+//      [<interval1> <interval2>]*
+// Like pulse_train, except that the first pulse begins at <time> instead of
+// immediately. The status is sent once the whole command has been read.
+void cmd_pulse_train_at(const uint8_t* args);
+void pulse_train_at_interval(const uint8_t* args, const uint8_t* item);
+void pulse_train_at_end(const uint8_t* args, bool complete);
+
+// <generate_pulses> <pin> <delay1> <delay2> <period1> <period2> <width1>
+//      <width2> <count1> <count2> <jitter1> <jitter2>
+// Start a train of <count> pulses on <pin>, or an endless one if <count> is 0,
+// which the device generates one edge at a time, so that it takes the same
+// memory however long it is. The first pulse begins <delay> ms after the
+// command was received, each lasts <width> ms, and each begins <period> ms
+// after the last plus a random extra of up to <jitter> ms. Stop it early with
+// cancel_pin. Sends a schedule status to serial output.
+void cmd_generate_pulses(const uint8_t* args);
+
+// <send_bytes> <pin> <interval1> <interval2> <width1> <width2> <checksum>
+//      <count> [<byte>]*
+// Immediately send <count> bytes as a low-bitrate serial code on <pin> (see
+// gk_schedule_write_bytes), with bits <interval> ms apart and 1-bits <width>
+// ms long, followed by their CRC8 if <checksum> is nonzero. Sends a schedule
+// status to serial output once the whole command has been read.
+void cmd_send_bytes(const uint8_t* args);
+void send_bytes_byte(const uint8_t* args, const uint8_t* item);
+void send_bytes_end(const uint8_t* args, bool complete);
+
+// <set_carrier> <pin> <freq1> <freq2> <freq3> <freq4> <duty>
+// Modulate <pin>'s output on a carrier of <freq> millihertz, which is on for
+// <duty>/256 of each cycle (see gkutil/modulation.h). The frequency is shared
+// with any other pins on the same timer. Sends the frequency actually produced
+// to serial output, in millihertz (4 bytes), or 0 if the pin can't be
+// modulated. A <freq> of 0 stops modulating the pin.
+void cmd_set_carrier(const uint8_t* args);
+
+// <get_stats>
+// Send timing statistics gathered since startup or the last reset_stats to
+// serial output, each big-endian (see gk_schedule_get_stats):
+//   fine_unit_ps (4): length of a gk_time_fine() unit, in picoseconds, which
+//       all of the durations below are measured in
+//   events (4), lateness_total (4), lateness_max (4): scheduled events
+//       executed, and their total and greatest lateness
+//   lateness (2 each, GK_SCHEDULE_LATENESS_BUCKETS of them): histogram of
+//       lateness, by powers of two
+//   loops (4), loop_total (4), loop_max (4): main loop iterations, and their
+//       total and greatest length
+//   peak_size (1), capacity (1): most events ever in the schedule at once, and
+//       how many it can hold
+//   schedule_overflows (2): events dropped because the schedule was full
+//   listener_overflows (2): input changes dropped because the queue was full
+//   rx_high_water (2), rx_buffer_size (2): most bytes ever waiting in the
+//       serial receive buffer, and its size
+//   frame_errors (2): frames discarded for a bad length or checksum, or for
+//       stalling
+// Everything but capacity, the overflows and rx_buffer_size is 0 if the
+// library was built without GK_SCHEDULE_STATS.
+void cmd_get_stats(const uint8_t* args);
+
+// <reset_stats>
+// Start gathering the statistics sent by get_stats afresh.
+void cmd_reset_stats(const uint8_t* args);
+
+// <set_data_rate> <rate1> <rate2> <rate3> <rate4>
+// Switch the serial link to <rate> bits per second. Sends the rate the UART
+// will actually run at (4 bytes), or 0 if it can't run within
+// DATA_RATE_MAX_ERROR thousandths of <rate>, in which case nothing changes.
+// Once the response has gone out at the old rate, the device switches, and
+// then ignores every command but confirm_data_rate until it arrives; if it
+// doesn't arrive within DATA_RATE_CONFIRM_MS, the device goes back to the old
+// rate.
+void cmd_set_data_rate(const uint8_t* args);
+
+// <confirm_data_rate> <rate1> <rate2> <rate3> <rate4>
+// Confirm the change to <rate> made by set_data_rate. Sends 1 to serial output
+// if <rate> is the current rate (whether or not a change was waiting), or 0.
+void cmd_confirm_data_rate(const uint8_t* args);
+
+// <read_all> <count>
+// Read every input at once (see gk_ports_snapshot), and send the time of the
+// reading (4 bytes) to serial output, followed by the levels of pins 0 to
+// 8*<count>-1, eight to a byte, lowest pin in the lowest bit. Pins the board
+// doesn't have read as 0.
+void cmd_read_all(const uint8_t* args);
+
+// <set_debounce> <pin> <length>
+// Debounce input <pin> (see gkutil/debounce.h): a new level is only read, or
+// reported to listeners, once it has been seen in <length> samples in a row,
+// taken every GK_DEBOUNCE_PERIOD_US. A <length> of 0 stops debouncing the pin.
+// Sends 1 to serial output if it worked, or 0 if <pin> doesn't exist or
+// <length> is more than GK_DEBOUNCE_MAX_LENGTH.
+void cmd_set_debounce(const uint8_t* args);
+
+// <start_sampling> <rate1> <rate2> <rate3> <rate4> <count> [<pin>]*
+// Sample the <count> pins listed at <rate> millihertz (see gkutil/sampler.h),
+// and stream the samples to the host; see SAMPLES_TAG. Sends to serial output
+// the rate actually produced, in millihertz (4 bytes), or 0 if sampling
+// couldn't start; the time of sample 0 (4 bytes); the bytes in each sample
+// (1 byte); and the position of each pin listed within a sample (1 byte each:
+// the byte times 8, plus the bit), or 255 for a pin that can't be sampled.
+// Sampling already under way is stopped first, as by stop_sampling. Output
+// is tagged from this command until stop_sampling, even if sampling couldn't
+// start, as while listening.
+void cmd_start_sampling(const uint8_t* args);
+void start_sampling_pin(const uint8_t* args, const uint8_t* item);
+void start_sampling_end(const uint8_t* args, bool complete);
+
+// <stop_sampling>
+// Stop sampling, and send the samples still waiting. Then sends the number
+// of samples dropped because they couldn't be sent quickly enough (2 bytes)
+// to serial output.
+void cmd_stop_sampling(const uint8_t* args);
+
+// <set_reflex> <rule> <input> <edges> <output> <delay1> <delay2>
+//     <width1> <width2> <period1> <period2> <count1> <count2>
+//     <window1> <window2> <limit>
+// Set reflex <rule> (up to REFLEX_MAX_RULES - 1), replacing any rule already
+// there: each change of <input> matching <edges> (REFLEX_RISING and/or
+// REFLEX_FALLING) schedules <count> pulses on <output>, the first <delay> ms
+// after the change, each <width> ms long and beginning <period> ms after the
+// last. This happens on the device as soon as the change is handled, with no
+// round trip to the host. If <window> is not 0, the rule only lasts for
+// <window> ms after the command is received; if <limit> is not 0, it only
+// fires <limit> times. Sends 1 to serial output if the rule was set, or 0 if
+// the rule, pins, or pulses are invalid, or <input> can't be listened to.
+void cmd_set_reflex(const uint8_t* args);
+
+// <clear_reflex> <rule>
+// Remove reflex <rule>. Sends the number of times it fired (2 bytes) to
+// serial output.
+void cmd_clear_reflex(const uint8_t* args);
+
+// <get_reflex_count> <rule>
+// Send the number of times reflex <rule> has fired (2 bytes) to serial output,
+// whether or not it is still in effect.
+void cmd_get_reflex_count(const uint8_t* args);
+
+gkTime read_time(const uint8_t* arg);
+uint16_t read_word(const uint8_t* arg);
+uint8_t schedule_status(gkTime time, uint16_t num_events);
+uint32_t uart_rate(uint32_t rate);
+void begin_data_rate(uint32_t rate);
+void update_data_rate();
+
+// Serial output tags, used while any pins are being listened to. Each response
+// to a command is preceded by RESPONSE_TAG, and input changes are sent in
+// frames of EDGES_TAG <count> [<pin> <time1> <time2> <time3> <time4>]*, where
+// the high bit of <pin> is set if the input went high.
+#define RESPONSE_TAG 0x01
+#define EDGES_TAG 0x02
+#define EDGE_SIZE 5
+// Most input changes to send in one frame; a full frame fits in the Uno's
+// serial transmit buffer, in either protocol
+#define EDGE_BATCH_MAX 11
+
+// Reflex rules (see set_reflex), which fire outputs on input changes without
+// involving the host
+#if RAMEND > 0x1000
+#define REFLEX_MAX_RULES 16
+#else
+#define REFLEX_MAX_RULES 4
+#endif
+#define REFLEX_RISING 0x01
+#define REFLEX_FALLING 0x02
+
+typedef struct ReflexRule {
+    gkPin input;            // GK_NOT_A_PIN once the rule is cleared or spent
+    uint8_t edges;          // REFLEX_RISING and/or REFLEX_FALLING
+    gkPin output;
+    uint8_t limit;          // firings left, or 0 for no limit
+    bool windowed;          // whether the rule ends at window_end
+    uint16_t count;         // pulses per firing
+    uint16_t fired;         // times fired
+    gkTime delay;
+    gkTime width;
+    gkTime period;
+    gkTime window_end;
+} ReflexRule;
+
+// Sampled inputs (see start_sampling) are sent in blocks of
+//   <index1> <index2> <index3> <index4> [<token>]*
+// where <index> is the number of the block's first sample, and each token is
+// either
+//   0nnnnnnn: n+1 samples the same as the one before, or
+//   1nnnnnnn [<byte>]*: n+1 samples, each given as its bytes XORed with those
+//       of the one before (so each byte is 0 if nothing in it changed).
+// The first sample of a block is XORed with zeros, so that every block stands
+// on its own, and idle inputs take about a byte per 128 samples. Blocks are
+// sent as SAMPLES_TAG <length> <block>, or in the framed protocol as frames
+// with <seq> EDGE_FRAME_SEQ holding SAMPLE_FRAME_MARK <block>. A block is sent
+// once it is full, or SAMPLE_BLOCK_MS after it began, and a new block begins
+// after any samples that were dropped.
+#define SAMPLES_TAG 0x03
+#define SAMPLE_FRAME_MARK 0xFF
+#define SAMPLE_BLOCK_MS 20
+// Largest block; one fits in the output queue, in either protocol
+#if RAMEND > 0x1000
+#define SAMPLE_BLOCK_MAX 240
+#else
+#define SAMPLE_BLOCK_MAX 56
+#endif
+
+// Framed protocol. Every frame, in either direction, is
+//   FRAME_SYNC <length> <seq> <payload...> <crc>
+// where <crc> is the CRC8 (gk_crc8_update) of <length>, <seq>, and the
+// <length> bytes of payload. A frame from the host carries one or more whole
+// commands, exactly as they would be sent in the raw protocol, all of which
+// are taken to be received when the frame began. The device answers every
+// frame with a frame of the same <seq> holding the responses of its commands
+// in order; the answer is empty if none of the commands respond, and is split
+// over several frames if it doesn't fit in one. Input changes are sent in
+// frames with <seq> EDGE_FRAME_SEQ, holding <count> [<pin> <time1..4>]*, and
+// nothing is tagged. A frame with a bad checksum, or one that stalls for more
+// than FRAME_TIMEOUT_MS, is discarded, and the device waits for the next
+// FRAME_SYNC. A command cut off by the end of its frame is dropped.
+#define FRAMING_VERSION 2
+#define FRAME_SYNC 0xA5
+#define FRAME_OVERHEAD 4
+#define EDGE_FRAME_SEQ 0
+#define FRAME_TIMEOUT_MS 50
+#if RAMEND > 0x1000
+#define FRAME_MAX_PAYLOAD 255
+#else
+#define FRAME_MAX_PAYLOAD 64
+#endif
+
+// Serial output is queued, and moved into the serial transmit buffer as it
+// has room, so that responses don't hold up the main loop while the link is
+// busy. Only if the queue fills up does writing to it wait.
+#if RAMEND > 0x1000
+#define TX_QUEUE_SIZE 256
+#else
+#define TX_QUEUE_SIZE 64
+#endif
+
+void begin_response();
+void response_write(uint8_t value);
+uint8_t listen_edge(gkPin pin, gkPinValue value, gkTime time);
+bool run_reflexes(gkPin pin, gkPinValue value, gkTime time);
+bool fire_reflex(const ReflexRule* rule, gkTime time);
+void clear_reflex(uint8_t index);
+void release_listener(gkPin pin);
+void send_edges();
+void report_edges();
+void encode_samples();
+void send_samples();
+void report_samples();
+void flush_samples();
+void receive_commands();
+void command_receive(uint8_t value);
+void command_abandon();
+bool receive_frame();
+void count_frame_error();
+void run_frame();
+void send_frame(uint8_t seq, uint8_t* payload, uint8_t length);
+void tx_write(uint8_t value);
+void tx_write_bytes(const uint8_t* data, uint8_t length);
+void tx_flush();
+
+// Handlers and argument lengths, by command byte
+const Command commands[] PROGMEM = {
+    {NULL, 0},
+    {cmd_config_output, 1},
+    {cmd_config_output_inverted, 1},
+    {cmd_pulse, 3},
+    {cmd_pulse_train, 2, 2, pulse_train_interval, pulse_train_end},
+    {cmd_pulse_after, 5},
+    {cmd_config_input_pullup, 1},
+    {cmd_config_input_nopullup, 1},
+    {cmd_read_pin, 1},
+    {cmd_get_clock, 0},
+    {cmd_get_last_clock, 0},
+//    {cmd_send_clock, ...},
+    {cmd_get_schedule_size, 0},
+    {cmd_get_tick_period, 0},
+    {cmd_cancel_pin, 1},
+    {cmd_get_pin_schedule_size, 1},
+    {cmd_start_listening, 1},
+    {cmd_stop_listening, 1},
+    {cmd_enable_framing, 0},
+    {cmd_sync, 0},
+    {cmd_write_at, 6},
+    {cmd_pulse_at, 7},
+    {cmd_pulse_train_at, 6, 2, pulse_train_at_interval, pulse_train_at_end},
+    {cmd_generate_pulses, 11},
+    {cmd_send_bytes, 7, 1, send_bytes_byte, send_bytes_end},
+    {cmd_set_carrier, 6},
+    {cmd_get_stats, 0},
+    {cmd_reset_stats, 0},
+    {cmd_set_data_rate, 4},
+    {cmd_confirm_data_rate, 4},
+    {cmd_read_all, 1},
+    {cmd_set_debounce, 2},
+    {cmd_start_sampling, 5, 1, start_sampling_pin, start_sampling_end},
+    {cmd_stop_sampling, 0},
+    {cmd_set_reflex, 15},
+    {cmd_clear_reflex, 1},
+    {cmd_get_reflex_count, 1},
 };
-const byte num_commands = sizeof(dispatchers) / sizeof(dispatchers[0]);
+const byte num_commands = sizeof(commands) / sizeof(commands[0]);
 
-// State used to track the number of bytes that have been received in a
-// multi-byte command, and track time offsets for pulse scheduling
-byte command_byte_count = 0;
+// Command parser state: whether a command's arguments or items are being
+// received, a copy of its entry in commands, its arguments followed by the
+// item being received, how many bytes of those have arrived, and how many
+// items are still to come
+enum { COMMAND_IDLE, COMMAND_ARGS, COMMAND_ITEMS } command_state = COMMAND_IDLE;
+Command command;
+uint8_t command_args[COMMAND_BUFFER_SIZE];
+uint8_t command_received;
+uint16_t command_items;
+
+// State used to track time offsets for pulse scheduling
 gkTime command_time_received;
+uint32_t command_fine_received;
 gkTime command_time_initiated;
 gkTime command_time_last_scheduled;
 gkTime command_time_completed;
+// Status of an absolute-time command that responds after its items
+uint8_t command_status;
+
+// Serial data rate; a rate to switch to once the response to set_data_rate
+// has gone out; and while a change waits for confirmation, the rate to go
+// back to (or 0) and when
+uint32_t data_rate = BAUD_RATE;
+uint32_t data_rate_next = 0;
+uint32_t data_rate_previous = 0;
+gkTime data_rate_deadline;
+
+// Framed protocol state: whether it is in use, the frame being received, and
+// the responses to the commands of the last frame received
+bool framing = false;
+enum { FRAME_HUNT, FRAME_LENGTH, FRAME_SEQ, FRAME_PAYLOAD, FRAME_CHECK }
+    frame_state = FRAME_HUNT;
+uint8_t frame_length, frame_seq, frame_received, frame_crc;
+gkTime frame_time_received;
+uint32_t frame_fine_received;
+uint8_t frame_payload[FRAME_MAX_PAYLOAD];
+uint8_t response_frame[FRAME_MAX_PAYLOAD];
+uint8_t response_length;
+bool response_sent;
+
+// Serial output waiting for room in the transmit buffer: tx_count bytes,
+// starting from tx_head
+uint8_t tx_queue[TX_QUEUE_SIZE];
+uint16_t tx_head = 0;
+uint16_t tx_count = 0;
+
+#if GK_SCHEDULE_STATS
+// Most bytes seen waiting in the serial receive buffer, and frames discarded
+uint16_t rx_high_water = 0;
+uint16_t frame_errors = 0;
+#endif
+#ifdef SERIAL_RX_BUFFER_SIZE
+#define RX_BUFFER_SIZE SERIAL_RX_BUFFER_SIZE
+#else
+#define RX_BUFFER_SIZE 64
+#endif
+
+// Pins being listened to, one bit per pin, and how many of them. Every pin
+// number the host can send has a bit, so that pins the board doesn't have
+// count too (see cmd_start_listening).
+uint8_t listening_pins[256 / 8] = {0};
+uint16_t num_listening_pins = 0;
+
+// Reflex rules, and whether any fired while handling input changes
+ReflexRule reflex_rules[REFLEX_MAX_RULES];
+bool reflexes_fired = false;
+// Input changes waiting to be sent to the host
+uint8_t edge_frame[2 + EDGE_BATCH_MAX * EDGE_SIZE] = {EDGES_TAG};
+uint8_t num_edges = 0;
+
+// Sample streaming state: whether start_sampling is in effect, the pins it
+// listed, the block being built (after room for its tag and length), how far
+// it goes, where its last token is (or 0), the number of the sample it expects
+// next, the sample before that, and when it must be sent. A sample taken from
+// the sampler that has to wait for a new block is held until then.
+bool sampling = false;
+uint8_t sample_pins[GK_NUM_PINS];
+uint8_t sample_block[2 + SAMPLE_BLOCK_MAX] = {SAMPLES_TAG};
+uint8_t sample_block_end = 0;
+uint8_t sample_token = 0;
+uint32_t sample_next_index;
+uint8_t sample_last[GK_NUM_PORTS];
+gkTime sample_block_deadline;
+bool sample_held = false;
+uint8_t sample_held_bytes[GK_NUM_PORTS];
+uint32_t sample_held_index;
 
 void setup() {
     gk_setup();
+    // Inputs read as their debounced levels once set_debounce is used on them
     for (uint8_t pin=2; pin<GK_NUM_PINS; ++pin) {
-        gk_pin_configure_simple(pin);
+        gk_pin_configure_debounced(pin);
     }
+    gk_schedule_setup();
 
     //gk_protect_serial_pins();
     //gk_modulation_setup();
-    //gk_listeners_setup();
-    Serial.begin(BAUD_RATE);
+    gk_listeners_setup();
+    gk_debounce_setup();
+    for (uint8_t i = 0; i < REFLEX_MAX_RULES; ++i)
+        reflex_rules[i].input = GK_NOT_A_PIN;
+    Serial.begin(data_rate);
     Serial.println("READY");
 }
 
 void loop() {
-    static CommandDispatcher* active_command = NULL;
+#if GK_SCHEDULE_STATS
+    uint16_t rx_waiting = Serial.available();
+    if (rx_waiting > rx_high_water)
+        rx_high_water = rx_waiting;
+#endif
 
-    // Perform any outputs according to the schedule
+    // Perform any outputs according to the schedule (only needed when the
+    // schedule isn't being executed from a timer interrupt)
+#if !GK_SCHEDULE_INTERRUPT
     gk_schedule_execute();
+#endif
+
+    // Run every command that has arrived. This is not an else: the input may
+    // switch to frames partway through, at enable_framing.
+    if (!framing)
+        receive_commands();
+    if (framing) {
+        while (!data_rate_next && receive_frame())
+            run_frame();
+    }
 
-    // If no command already in progress, check for a new command
-    if (!active_command && Serial.available()) {
-        // There is a command byte ready to read
-        command_time_received = millis();
-        byte cmd_byte = Serial.read();
-        if (cmd_byte < num_commands)
-            active_command = dispatchers[cmd_byte];
-        else
-            active_command = NULL;
+    // Sample debounced inputs, then handle listeners, and report any input
+    // changes to the host
+    gk_debounce_update();
+    report_edges();
+#if !GK_SCHEDULE_INTERRUPT
+    // Reflex outputs that are already due go out now, not on the next loop
+    if (reflexes_fired) {
+        reflexes_fired = false;
+        gk_schedule_execute();
     }
-    // Run the currently active command, if it exists
-    if (active_command && active_command())
-        // The command finished and can now be deactivated
-        active_command = NULL;
+#endif
+    if (sampling)
+        report_samples();
+    tx_flush();
+    update_data_rate();
+}
+
+void cmd_config_output(const uint8_t* args) {
+    uint8_t pin = args[0];
+    gk_pin_set_inverted(pin, false);
+    gk_pin_set_mode(pin, GK_PIN_MODE_OUTPUT, GK_PIN_WRITE_OFF);
+    command_time_initiated = gk_time_now();
+    command_time_completed = command_time_initiated;
+    command_time_last_scheduled = command_time_initiated;
+}
 
-    // Handle listeners
+void cmd_config_output_inverted(const uint8_t* args) {
+    uint8_t pin = args[0];
+    // The library writes inverted pins active-low, so "off" leaves it high
+    gk_pin_set_inverted(pin, true);
+    gk_pin_set_mode(pin, GK_PIN_MODE_OUTPUT, GK_PIN_WRITE_OFF);
+    command_time_initiated = gk_time_now();
+    command_time_completed = command_time_initiated;
+    command_time_last_scheduled = command_time_initiated;
+}
+
+void cmd_pulse(const uint8_t* args) {
+    uint8_t pin = args[0];
+    unsigned short duration = read_word(args + 1);
+    // Turn the pin on, unless the schedule is too full to turn it back off
+    // again, and schedule turning it off
+    if (gk_schedule_available())
+        gk_pin_write(pin, GK_PIN_WRITE_ON);
+    command_time_initiated = gk_time_now();
+    command_time_last_scheduled = command_time_initiated + gk_time_ms(duration);
+    gk_schedule_add(command_time_last_scheduled, pin, GK_PIN_WRITE_OFF);
+    command_time_completed = command_time_last_scheduled;
+}
 
+void cmd_pulse_after(const uint8_t* args) {
+    uint8_t pin = args[0];
+    unsigned short delay = read_word(args + 1);
+    unsigned short duration = read_word(args + 3);
+    // The delay begins from when this command was received, or from the end
+    // of an already-scheduled action on that pin.
+    if (!gk_schedule_pin_last(pin, &command_time_initiated))
+        command_time_initiated = command_time_received;
+    command_time_initiated += gk_time_ms(delay);
+    command_time_last_scheduled = command_time_initiated + gk_time_ms(duration);
+    command_time_completed = command_time_last_scheduled;
+    // Schedule nothing unless there is room to turn the pin back off
+    if (gk_schedule_available() < 2)
+        return;
+    gk_schedule_add(command_time_initiated, pin, GK_PIN_WRITE_ON);
+    gk_schedule_add(command_time_last_scheduled, pin, GK_PIN_WRITE_OFF);
 }
 
-bool cmd_config_output() {
-    uint8_t pin;
-    if (Serial.available()) {
-        pin = Serial.read();
-        invert_pin_output[pin] = false;
-        gk_pin_set_mode(pin, GK_PIN_MODE_OUTPUT, GK_PIN_WRITE_OFF);
-        command_time_initiated = millis();
-        command_time_completed = command_time_initiated;
-        command_time_last_scheduled = command_time_initiated;
-        return true;
+void cmd_pulse_train(const uint8_t* args) {
+    uint8_t pin = args[0];
+    uint8_t num_pulses = args[1];
+    command_time_initiated = gk_time_now();
+    command_time_last_scheduled = command_time_initiated;
+    if (!num_pulses)
+        return;
+    // Begin by turning the pin on, unless the schedule is too full to turn it
+    // back off again. For N pulses there are 2N-1 delay intervals between
+    // scheduled actions to follow.
+    if (gk_schedule_available())
+        gk_pin_write(pin, GK_PIN_WRITE_ON);
+    command_items = 2*num_pulses - 1;
+}
+
+void pulse_train_interval(const uint8_t* args, const uint8_t* item) {
+    uint8_t pin = args[0];
+    // If an odd number of intervals remain (counting this one), we are
+    // scheduling the pin to turn off; if even, we're scheduling it on.
+    gkPinAction action =
+        (command_items % 2) ? GK_PIN_WRITE_OFF : GK_PIN_WRITE_ON;
+    command_time_last_scheduled += gk_time_ms(read_word(item));
+    if (gk_schedule_add(command_time_last_scheduled, pin, action)
+            == GK_SCHEDULE_FULL && action == GK_PIN_WRITE_OFF) {
+        // Don't leave the pin stuck on if the schedule filled up
+        gk_pin_write(pin, action);
     }
-    return false;
 }
 
-bool cmd_config_output_inverted() {
-    uint8_t pin;
-    if (Serial.available()) {
-        pin = Serial.read();
-        invert_pin_output[pin] = true;
-        gk_pin_set_mode(pin, GK_PIN_MODE_OUTPUT, GK_PIN_WRITE_ON);
-        command_time_initiated = millis();
-        command_time_completed = command_time_initiated;
-        command_time_last_scheduled = command_time_initiated;
-        return true;
+void pulse_train_end(const uint8_t* args, bool complete) {
+    if (complete)
+        command_time_completed = command_time_last_scheduled;
+    else if (command_items % 2)
+        // Don't leave the pin on if the command was cut short
+        gk_schedule_add(
+            command_time_last_scheduled, args[0], GK_PIN_WRITE_OFF);
+}
+
+void cmd_config_input_pullup(const uint8_t* args) {
+    gk_pin_set_mode(args[0], GK_PIN_MODE_INPUT, GK_PIN_PULLUP_ON);
+}
+
+void cmd_config_input_nopullup(const uint8_t* args) {
+    gk_pin_set_mode(args[0], GK_PIN_MODE_INPUT, GK_PIN_PULLUP_OFF);
+}
+
+void cmd_read_pin(const uint8_t* args) {
+    bool value = gk_pin_read(args[0]);
+    begin_response();
+    response_write(value);
+}
+
+void cmd_get_clock(const uint8_t* args) {
+    begin_response();
+    serial_write_bigendian(
+        (uint8_t*)&command_time_received,
+        sizeof(command_time_received)
+    );
+}
+
+void cmd_get_last_clock(const uint8_t* args) {
+    begin_response();
+    serial_write_bigendian(
+        (uint8_t*)&command_time_initiated,
+        sizeof(command_time_initiated)
+    );
+}
+
+void cmd_get_schedule_size(const uint8_t* args) {
+    begin_response();
+    response_write(gk_schedule_size());
+}
+
+void cmd_get_tick_period(const uint8_t* args) {
+    uint32_t period = gk_time_period_ns();
+    begin_response();
+    serial_write_bigendian((uint8_t*)&period, sizeof(period));
+}
+
+void cmd_cancel_pin(const uint8_t* args) {
+    uint8_t pin = args[0];
+    gk_schedule_cancel_pin(pin);
+    gk_pin_write(pin, GK_PIN_WRITE_OFF);
+}
+
+void cmd_get_pin_schedule_size(const uint8_t* args) {
+    begin_response();
+    response_write(gk_schedule_pin_size(args[0]));
+}
+
+void cmd_start_listening(const uint8_t* args) {
+    uint8_t pin = args[0];
+    bool ok = pin < GK_NUM_PINS && gk_listener_set(pin, listen_edge);
+    // The pin counts as listened to even if it can't be, so that the host
+    // can always tell whether output is being tagged.
+    if (!(listening_pins[pin / 8] & _BV(pin % 8))) {
+        listening_pins[pin / 8] |= _BV(pin % 8);
+        ++num_listening_pins;
     }
-    return false;
+    begin_response();
+    response_write(ok);
 }
 
-bool cmd_pulse() {
-    static uint8_t pin;
-    static uint8_t step = 0;
-
-    if (step == 0 && Serial.available()) {
-        // Read which pin to pulse, and immediately turn it on
-        pin = Serial.read();
-        gk_pin_write(pin, PIN_ON_VALUE(pin));
-        // Update scheduling time steps
-        command_time_initiated = millis();
-        command_time_last_scheduled = command_time_initiated;
-        ++step;
-    }
-    if (step == 1 && Serial.available() >= 2) {
-        // Read for how long the pin is to remain on, and schedule turning
-        // it off
-        uint8_t b1 = Serial.read();
-        uint8_t b2 = Serial.read();
-        unsigned short duration = word(b1, b2);
-        command_time_last_scheduled += duration;
+void cmd_stop_listening(const uint8_t* args) {
+    uint8_t pin = args[0];
+    bool was_listening = listening_pins[pin / 8] & _BV(pin % 8);
+    if (was_listening && num_listening_pins == 1) {
+        // Output goes back to being untagged after this, so anything
+        // still waiting must be sent now.
+        gk_listeners_execute();
+        if (num_edges) {
+            send_edges();
+        }
+    }
+    begin_response();
+    response_write(was_listening);
+    if (was_listening) {
+        listening_pins[pin / 8] &= ~_BV(pin % 8);
+        --num_listening_pins;
+        release_listener(pin);
+    }
+}
+
+// Stop listening to pin, unless its changes are still being reported or
+// waited for by a reflex rule
+void release_listener(gkPin pin) {
+    if (pin >= GK_NUM_PINS || (listening_pins[pin / 8] & _BV(pin % 8)))
+        return;
+    for (uint8_t i = 0; i < REFLEX_MAX_RULES; ++i) {
+        if (reflex_rules[i].input == pin)
+            return;
+    }
+    gk_listener_clear(pin);
+}
+
+void cmd_enable_framing(const uint8_t* args) {
+    begin_response();
+    response_write(FRAMING_VERSION);
+    framing = true;
+}
+
+void cmd_sync(const uint8_t* args) {
+    uint16_t fine_per_unit = GK_TIME_FINE_PER_UNIT;
+    begin_response();
+    serial_write_bigendian((uint8_t*)&fine_per_unit, sizeof(fine_per_unit));
+    serial_write_bigendian(
+        (uint8_t*)&command_fine_received,
+        sizeof(command_fine_received)
+    );
+    uint32_t fine_replied = gk_time_fine();
+    gkTime time_replied = gk_time_now();
+    serial_write_bigendian((uint8_t*)&fine_replied, sizeof(fine_replied));
+    serial_write_bigendian(
+        (uint8_t*)&command_time_received,
+        sizeof(command_time_received)
+    );
+    serial_write_bigendian((uint8_t*)&time_replied, sizeof(time_replied));
+}
+
+void cmd_write_at(const uint8_t* args) {
+    uint8_t pin = args[0];
+    bool on = args[1];
+    gkTime time = read_time(args + 2);
+    uint8_t status = schedule_status(time, 1);
+    if (status == SCHEDULE_OK) {
         gk_schedule_add(
-            command_time_last_scheduled,
-            pin,
-            PIN_OFF_VALUE(pin)
-        );
-        // Update the time at which the last event from this command will be
-        // completed, reset the state of this command reader, and report
-        // that the command has been completely read.
-        command_time_completed = command_time_last_scheduled;
-        step = 0;
-        return true;
+            time, pin, on ? GK_PIN_WRITE_ON : GK_PIN_WRITE_OFF);
+        command_time_initiated = time;
+        command_time_last_scheduled = time;
+        command_time_completed = time;
     }
-    return false;
+    begin_response();
+    response_write(status);
 }
 
-bool cmd_pulse_after() {
-    static uint8_t pin;
-    static uint8_t step = 0;
+void cmd_pulse_at(const uint8_t* args) {
+    uint8_t pin = args[0];
+    gkTime time = read_time(args + 1);
+    unsigned short duration = read_word(args + 5);
+    uint8_t status = schedule_status(time, 2);
+    if (status == SCHEDULE_OK) {
+        gk_schedule_add(time, pin, GK_PIN_WRITE_ON);
+        command_time_initiated = time;
+        command_time_last_scheduled = time + gk_time_ms(duration);
+        gk_schedule_add(
+            command_time_last_scheduled, pin, GK_PIN_WRITE_OFF);
+        command_time_completed = command_time_last_scheduled;
+    }
+    begin_response();
+    response_write(status);
+}
 
-    if (step == 0 && Serial.available()) {
-        // Read which pin to pulse
-        pin = Serial.read();
-        ++step;
+void cmd_pulse_train_at(const uint8_t* args) {
+    // Check that the whole train can be scheduled before scheduling its first
+    // pulse; if not, the intervals are just read and ignored.
+    uint8_t pin = args[0];
+    gkTime time = read_time(args + 1);
+    uint8_t num_pulses = args[5];
+    command_status = schedule_status(time, 2*num_pulses);
+    if (command_status == SCHEDULE_OK && num_pulses) {
+        gk_schedule_add(time, pin, GK_PIN_WRITE_ON);
+        command_time_initiated = time;
+        command_time_last_scheduled = time;
     }
-    if (step == 1 && Serial.available() >= 2) {
-        // Read for how long to delay before turning the pin on, then determine
-        // whether that delay begins from when this command was received or
-        // from the end of an already-scheduled action on that pin.
-        uint8_t b1 = Serial.read();
-        uint8_t b2 = Serial.read();
-        unsigned short delay = word(b1, b2);
-        // Check for the last scheduled event on this pin
-        command_time_initiated = command_time_received;
-        gkScheduleIterator iter = gk_schedule_tail();
-        while (iter) {
-            gkScheduledEvent *const event = gk_schedule_get(iter);
-            if (event->pin == pin) {
-                command_time_initiated = event->time;
-                break;
-            } else {
-                iter = gk_schedule_prev(iter);
-            }
-        }
+    // For N pulses there are 2N-1 delay intervals between scheduled actions
+    command_items = num_pulses ? 2*num_pulses - 1 : 0;
+}
 
-        command_time_initiated += delay;
-        gk_schedule_add(command_time_initiated, pin, PIN_ON_VALUE(pin));
-        // Update the scheduling time steps
-        command_time_last_scheduled = command_time_initiated;
-        ++step;
-    }
-    if (step == 2 && Serial.available() >= 2) {
-        // Read for how long to delay before turning the pin off, and schedule
-        // that following the turn on.
-        uint8_t b1 = Serial.read();
-        uint8_t b2 = Serial.read();
-        unsigned short duration = word(b1, b2);
-        command_time_last_scheduled += duration;
-        gk_schedule_add(command_time_last_scheduled, pin, PIN_OFF_VALUE(pin));
-        // Clean up and report that the command has been processed.
+void pulse_train_at_interval(const uint8_t* args, const uint8_t* item) {
+    uint8_t pin = args[0];
+    if (command_status != SCHEDULE_OK)
+        return;
+    gkPinAction action =
+        (command_items % 2) ? GK_PIN_WRITE_OFF : GK_PIN_WRITE_ON;
+    command_time_last_scheduled += gk_time_ms(read_word(item));
+    gk_schedule_add(command_time_last_scheduled, pin, action);
+}
+
+void pulse_train_at_end(const uint8_t* args, bool complete) {
+    if (!complete) {
+        // Don't leave the pin on if the command was cut short
+        if (command_status == SCHEDULE_OK && command_items % 2)
+            gk_schedule_add(
+                command_time_last_scheduled, args[0], GK_PIN_WRITE_OFF);
+        return;
+    }
+    if (command_status == SCHEDULE_OK)
         command_time_completed = command_time_last_scheduled;
-        step = 0;
-        return true;
+    begin_response();
+    response_write(command_status);
+}
+
+void cmd_generate_pulses(const uint8_t* args) {
+    uint8_t pin = args[0];
+    gkTime start = command_time_received + gk_time_ms(read_word(args + 1));
+    gkTime period = gk_time_ms(read_word(args + 3));
+    gkTime width = gk_time_ms(read_word(args + 5));
+    uint16_t count = read_word(args + 7);
+    gkTime jitter = gk_time_ms(read_word(args + 9));
+    uint8_t status = SCHEDULE_OK;
+    // Pulses as long as the period would run into each other
+    if (count != 1 && width >= period)
+        status = SCHEDULE_INVALID;
+    else if (gk_schedule_pulse_train(
+            start, pin, GK_PIN_WRITE_ON, GK_PIN_WRITE_OFF,
+            period, width, count, jitter) == GK_SCHEDULE_FULL)
+        status = SCHEDULE_NO_ROOM;
+    begin_response();
+    response_write(status);
+}
+
+// Bytes received so far by send_bytes
+uint8_t send_bytes_data[GK_SCHEDULE_WRITE_MAX];
+
+void cmd_send_bytes(const uint8_t* args) {
+    command_items = args[6];
+}
+
+void send_bytes_byte(const uint8_t* args, const uint8_t* item) {
+    // Keep only as many bytes as can be sent; if there are too many, the rest
+    // are read and ignored, and nothing is sent.
+    uint8_t index = args[6] - command_items;
+    if (index < GK_SCHEDULE_WRITE_MAX)
+        send_bytes_data[index] = item[0];
+}
+
+void send_bytes_end(const uint8_t* args, bool complete) {
+    if (!complete)
+        return;
+    uint8_t pin = args[0];
+    uint16_t interval = read_word(args + 1);
+    uint16_t width = read_word(args + 3);
+    bool checksum = args[5];
+    uint8_t count = args[6];
+    uint8_t status = SCHEDULE_NO_ROOM;
+    if (count <= GK_SCHEDULE_WRITE_MAX) {
+        uint8_t length = checksum
+            ? gk_schedule_write_bytes_with_checksum(
+                0, pin, gk_time_ms(interval), gk_time_ms(width),
+                count, send_bytes_data)
+            : gk_schedule_write_bytes(
+                0, pin, gk_time_ms(interval), gk_time_ms(width),
+                count, send_bytes_data);
+        if (length != GK_SCHEDULE_FULL)
+            status = SCHEDULE_OK;
+    }
+    begin_response();
+    response_write(status);
+}
+
+void cmd_set_carrier(const uint8_t* args) {
+    uint8_t pin = args[0];
+    uint32_t frequency = read_word(args + 1);
+    frequency = (frequency << 16) | read_word(args + 3);
+    uint8_t duty = args[5];
+    uint32_t achieved = 0;
+    if (!frequency)
+        gk_modulation_release(pin);
+    else if (gk_modulation_configure(pin))
+        achieved = gk_modulation_set_carrier(pin, frequency, duty);
+    begin_response();
+    serial_write_bigendian((uint8_t*)&achieved, sizeof(achieved));
+}
+
+void cmd_get_stats(const uint8_t* args) {
+    uint32_t fine_unit_ps =
+        (uint64_t)gk_time_period_ns() * 1000 / GK_TIME_FINE_PER_UNIT;
+    uint8_t capacity = SCHEDULE_BUFFER_SIZE;
+    uint16_t schedule_overflows = gk_schedule_overflows();
+    uint16_t listener_overflows = gk_listeners_overflows();
+    uint16_t rx_buffer_size = RX_BUFFER_SIZE;
+#if GK_SCHEDULE_STATS
+    gkScheduleStats stats;
+    gk_schedule_get_stats(&stats);
+    uint16_t rx_high = rx_high_water;
+    uint16_t errors = frame_errors;
+#else
+    struct {
+        uint32_t events, lateness_total, lateness_max;
+        uint16_t lateness[GK_SCHEDULE_LATENESS_BUCKETS];
+        uint32_t loops, loop_total, loop_max;
+        uint8_t peak_size;
+    } stats = {0};
+    uint16_t rx_high = 0;
+    uint16_t errors = 0;
+#endif
+    begin_response();
+    serial_write_bigendian((uint8_t*)&fine_unit_ps, 4);
+    serial_write_bigendian((uint8_t*)&stats.events, 4);
+    serial_write_bigendian((uint8_t*)&stats.lateness_total, 4);
+    serial_write_bigendian((uint8_t*)&stats.lateness_max, 4);
+    for (uint8_t i = 0; i < GK_SCHEDULE_LATENESS_BUCKETS; ++i)
+        serial_write_bigendian((uint8_t*)&stats.lateness[i], 2);
+    serial_write_bigendian((uint8_t*)&stats.loops, 4);
+    serial_write_bigendian((uint8_t*)&stats.loop_total, 4);
+    serial_write_bigendian((uint8_t*)&stats.loop_max, 4);
+    response_write(stats.peak_size);
+    response_write(capacity);
+    serial_write_bigendian((uint8_t*)&schedule_overflows, 2);
+    serial_write_bigendian((uint8_t*)&listener_overflows, 2);
+    serial_write_bigendian((uint8_t*)&rx_high, 2);
+    serial_write_bigendian((uint8_t*)&rx_buffer_size, 2);
+    serial_write_bigendian((uint8_t*)&errors, 2);
+}
+
+void cmd_reset_stats(const uint8_t* args) {
+#if GK_SCHEDULE_STATS
+    gk_schedule_reset_stats();
+    rx_high_water = 0;
+    frame_errors = 0;
+#else
+    gk_schedule_clear_overflows();
+#endif
+    gk_listeners_clear_overflows();
+}
+
+void cmd_set_data_rate(const uint8_t* args) {
+    uint32_t rate = read_word(args);
+    rate = (rate << 16) | read_word(args + 2);
+    uint32_t achieved = uart_rate(rate);
+    uint32_t error = achieved > rate ? achieved - rate : rate - achieved;
+    if (error > rate / 1000 * DATA_RATE_MAX_ERROR)
+        achieved = 0;
+    if (achieved)
+        data_rate_next = rate;
+    begin_response();
+    serial_write_bigendian((uint8_t*)&achieved, sizeof(achieved));
+}
+
+void cmd_confirm_data_rate(const uint8_t* args) {
+    uint32_t rate = read_word(args);
+    rate = (rate << 16) | read_word(args + 2);
+    bool ok = rate == data_rate;
+    if (ok)
+        data_rate_previous = 0;
+    begin_response();
+    response_write(ok);
+}
+
+void cmd_read_all(const uint8_t* args) {
+    gkPortsSnapshot snapshot;
+    gk_ports_snapshot(&snapshot);
+    begin_response();
+    serial_write_bigendian((uint8_t*)&snapshot.time, sizeof(snapshot.time));
+    for (uint8_t i = 0; i < args[0]; ++i)
+        response_write(i < GK_PORTS_SNAPSHOT_SIZE ? snapshot.pins[i] : 0);
+}
+
+void cmd_set_debounce(const uint8_t* args) {
+    bool ok = gk_debounce_set(args[0], args[1]);
+    begin_response();
+    response_write(ok);
+}
+
+void cmd_start_sampling(const uint8_t* args) {
+    if (sampling)
+        flush_samples();
+    gk_sampler_clear_pins();
+    command_items = args[4];
+}
+
+void start_sampling_pin(const uint8_t* args, const uint8_t* item) {
+    uint8_t index = args[4] - command_items;
+    if (index < sizeof(sample_pins))
+        sample_pins[index] = item[0];
+    gk_sampler_add_pin(item[0]);
+}
+
+void start_sampling_end(const uint8_t* args, bool complete) {
+    if (!complete)
+        return;
+    uint32_t rate = read_word(args);
+    rate = (rate << 16) | read_word(args + 2);
+    uint32_t achieved = gk_sampler_start(rate);
+    gkTime start = gk_sampler_start_time();
+    uint8_t width = gk_sampler_width();
+    sampling = true;
+    sample_block_end = 0;
+    sample_held = false;
+    begin_response();
+    serial_write_bigendian((uint8_t*)&achieved, sizeof(achieved));
+    serial_write_bigendian((uint8_t*)&start, sizeof(start));
+    response_write(width);
+    for (uint8_t i = 0; i < args[4]; ++i) {
+        response_write(i < sizeof(sample_pins)
+            ? gk_sampler_pin_position(sample_pins[i]) : GK_NOT_A_PIN);
+    }
+}
+
+void cmd_stop_sampling(const uint8_t* args) {
+    uint16_t overflows = 0;
+    if (sampling) {
+        flush_samples();
+        overflows = gk_sampler_overflows();
+    }
+    begin_response();
+    serial_write_bigendian((uint8_t*)&overflows, sizeof(overflows));
+    sampling = false;
+}
+
+void cmd_set_reflex(const uint8_t* args) {
+    uint8_t index = args[0];
+    gkPin input = args[1];
+    uint8_t edges = args[2];
+    gkPin output = args[3];
+    uint16_t width = read_word(args + 6);
+    uint16_t period = read_word(args + 8);
+    uint16_t count = read_word(args + 10);
+    uint16_t window = read_word(args + 12);
+    bool ok = index < REFLEX_MAX_RULES
+        && input < GK_NUM_PINS && output < GK_NUM_PINS
+        && edges && !(edges & ~(REFLEX_RISING | REFLEX_FALLING))
+        && count && (count == 1 || width < period);
+    if (index < REFLEX_MAX_RULES)
+        clear_reflex(index);
+    if (ok)
+        ok = gk_listener_set(input, listen_edge);
+    if (ok) {
+        ReflexRule* rule = &reflex_rules[index];
+        rule->edges = edges;
+        rule->output = output;
+        rule->limit = args[14];
+        rule->windowed = window != 0;
+        rule->count = count;
+        rule->fired = 0;
+        rule->delay = gk_time_ms(read_word(args + 4));
+        rule->width = gk_time_ms(width);
+        rule->period = gk_time_ms(period);
+        rule->window_end = command_time_received + gk_time_ms(window);
+        rule->input = input;
+    }
+    begin_response();
+    response_write(ok);
+}
+
+void cmd_clear_reflex(const uint8_t* args) {
+    uint16_t fired = 0;
+    if (args[0] < REFLEX_MAX_RULES) {
+        fired = reflex_rules[args[0]].fired;
+        clear_reflex(args[0]);
+    }
+    begin_response();
+    serial_write_bigendian((uint8_t*)&fired, sizeof(fired));
+}
+
+void cmd_get_reflex_count(const uint8_t* args) {
+    uint16_t fired = 0;
+    if (args[0] < REFLEX_MAX_RULES)
+        fired = reflex_rules[args[0]].fired;
+    begin_response();
+    serial_write_bigendian((uint8_t*)&fired, sizeof(fired));
+}
+
+// Remove a reflex rule, and stop listening to its input if nothing else needs
+// it
+void clear_reflex(uint8_t index) {
+    ReflexRule* rule = &reflex_rules[index];
+    gkPin input = rule->input;
+    rule->input = GK_NOT_A_PIN;
+    rule->fired = 0;
+    release_listener(input);
+}
+
+// Read a 2-byte big-endian argument
+uint16_t read_word(const uint8_t* arg) {
+    return word(arg[0], arg[1]);
+}
+
+// Read a 4-byte big-endian time argument
+gkTime read_time(const uint8_t* arg) {
+    gkTime time = 0;
+    for (uint8_t i = 0; i < 4; ++i)
+        time = (time << 8) | arg[i];
+    return time;
+}
+
+// The rate the UART actually runs at when Serial.begin is asked for rate,
+// which, like the Arduino core, uses the double-speed (U2X) setting unless
+// the divisor would be too large, or 0 if it can't run near rate at all
+uint32_t uart_rate(uint32_t rate) {
+    if (!rate || rate > F_CPU / 8)
+        return 0;
+    uint32_t setting = (F_CPU / 4 / rate - 1) / 2;
+    if ((F_CPU == 16000000UL && rate == 57600) || setting > 4095) {
+        setting = (F_CPU / 8 / rate - 1) / 2;
+        if (setting > 4095)
+            return 0;
+        return F_CPU / 16 / (setting + 1);
+    }
+    return F_CPU / 8 / (setting + 1);
+}
+
+// Switch the serial port to rate, once everything already written has gone
+// out. Anything received but not yet read is dropped, as it may be garbled,
+// along with any partly received command or frame.
+void begin_data_rate(uint32_t rate) {
+    while (tx_count)
+        tx_flush();
+    Serial.flush();
+    Serial.end();
+    Serial.begin(rate);
+    command_abandon();
+    frame_state = FRAME_HUNT;
+}
+
+// Change the data rate once the response to set_data_rate has gone out, or
+// go back if the change hasn't been confirmed in time
+void update_data_rate() {
+    if (data_rate_next) {
+        data_rate_previous = data_rate;
+        data_rate = data_rate_next;
+        data_rate_next = 0;
+        begin_data_rate(data_rate);
+        data_rate_deadline = gk_time_now() + gk_time_ms(DATA_RATE_CONFIRM_MS);
+    } else if (data_rate_previous
+            && gk_time_after(gk_time_now(), data_rate_deadline)) {
+        data_rate = data_rate_previous;
+        data_rate_previous = 0;
+        begin_data_rate(data_rate);
+    }
+}
+
+// Check whether num_events writes can be scheduled, starting at time
+uint8_t schedule_status(gkTime time, uint16_t num_events) {
+    if (gk_time_before(time, gk_time_now()))
+        return SCHEDULE_LATE;
+    if (num_events > gk_schedule_available())
+        return SCHEDULE_NO_ROOM;
+    return SCHEDULE_OK;
+}
+
+// Tag a response to a command, if output is being tagged
+void begin_response() {
+    if ((num_listening_pins || sampling) && !framing)
+        tx_write(RESPONSE_TAG);
+}
+
+// Write one byte of a response to a command. In the framed protocol, the
+// response is collected into the frame answering the current one.
+void response_write(uint8_t value) {
+    if (!framing) {
+        tx_write(value);
+        return;
     }
+    if (response_length == FRAME_MAX_PAYLOAD) {
+        send_frame(frame_seq, response_frame, response_length);
+        response_length = 0;
+        response_sent = true;
+    }
+    response_frame[response_length++] = value;
+}
+
+// Listener callback: fire any reflex rules on the input change, then add it to
+// the frame being built if the pin is being listened to, sending the frame
+// first if it is full. The listener removes itself once nothing needs it.
+uint8_t listen_edge(gkPin pin, gkPinValue value, gkTime time) {
+    bool reflexes_waiting = run_reflexes(pin, value, time);
+    if (!(listening_pins[pin / 8] & _BV(pin % 8)))
+        return !reflexes_waiting;
+    if (num_edges == EDGE_BATCH_MAX)
+        send_edges();
+    uint8_t* edge = edge_frame + 2 + num_edges * EDGE_SIZE;
+    edge[0] = pin | ((value == GK_PIN_LEVEL_HIGH) ? 0x80 : 0);
+    edge[1] = time >> 24;
+    edge[2] = time >> 16;
+    edge[3] = time >> 8;
+    edge[4] = time;
+    edge_frame[1] = ++num_edges;
     return false;
 }
 
-bool cmd_pulse_train() {
-    static uint8_t pin, num_to_process;
-    static uint8_t step = 0;
-
-    if (step == 0 && Serial.available()) {
-        // Read which pin we're scheduling a train for and begin by turning it
-        // on.
-        pin = Serial.read();
-        gk_pin_write(pin, PIN_ON_VALUE(pin));
-        command_time_initiated = millis();
-        command_time_last_scheduled = command_time_initiated;
-        ++step;
-    }
-    if (step == 1 && Serial.available()) {
-        // Read how many pulses this train consists of.
-        uint8_t num_pulses = Serial.read();
-        if (num_pulses) {
-            // For N pulses there are 2N-1 delay intervals between scheduled
-            // actions
-            num_to_process = 2*num_pulses - 1;
-            ++step;
-        } else {
-            // 0 pulses? Weird. We'll just end now.
-            command_time_completed = command_time_initiated;
-            step = 0;
-            return true;
+// Fire the reflex rules matching an input change. Outputs are scheduled from
+// the time of the change, so they keep the same timing however long the change
+// waited to be handled. A firing that doesn't fit in the schedule is skipped,
+// and counts as a schedule overflow rather than against the rule's limit.
+// Returns true if any rules are still waiting for changes of pin.
+bool run_reflexes(gkPin pin, gkPinValue value, gkTime time) {
+    uint8_t edge =
+        (value == GK_PIN_LEVEL_HIGH) ? REFLEX_RISING : REFLEX_FALLING;
+    bool waiting = false;
+    for (uint8_t i = 0; i < REFLEX_MAX_RULES; ++i) {
+        ReflexRule* rule = &reflex_rules[i];
+        if (rule->input != pin)
+            continue;
+        if (rule->windowed && gk_time_after(time, rule->window_end)) {
+            rule->input = GK_NOT_A_PIN;
+            continue;
         }
+        if ((rule->edges & edge) && fire_reflex(rule, time)) {
+            ++rule->fired;
+            reflexes_fired = true;
+            if (rule->limit && !--rule->limit) {
+                rule->input = GK_NOT_A_PIN;
+                continue;
+            }
+        }
+        waiting = true;
     }
-    if (step == 2) {
-        // Read a total of 2N-1 delay intervals, each 2 bytes
-        while (num_to_process && Serial.available() >= 2) {
-            uint8_t b1 = Serial.read();
-            uint8_t b2 = Serial.read();
-            unsigned short delay = word(b1, b2);
-            // If num_to_process is odd, we are scheduling the pin to turn off;
-            // if even, we're scheduling it on.
-            gkPinAction action =
-                (num_to_process % 2) ? PIN_OFF_VALUE(pin) : PIN_ON_VALUE(pin);
-            command_time_last_scheduled += delay;
-            gk_schedule_add(command_time_last_scheduled, pin, action);
-            --num_to_process;
+    return waiting;
+}
+
+// Schedule a reflex rule's pulses for an input change at time. Returns false
+// if the schedule had no room for them.
+bool fire_reflex(const ReflexRule* rule, gkTime time) {
+    gkPin pin = rule->output;
+    gkTime start = time + rule->delay;
+    if (rule->count > 1) {
+        return gk_schedule_pulse_train(
+            start, pin, GK_PIN_WRITE_ON, GK_PIN_WRITE_OFF,
+            rule->period, rule->width, rule->count, 0) != GK_SCHEDULE_FULL;
+    }
+    if (gk_schedule_available() < 2)
+        return false;
+    gk_schedule_add(start, pin, GK_PIN_WRITE_ON);
+    gk_schedule_add(start + rule->width, pin, GK_PIN_WRITE_OFF);
+    return true;
+}
+
+// Send queued input changes to the host. Changes are collected into a frame
+// while the serial link is busy, and the frame is sent once the transmit
+// buffer has room for all of it after any output already queued, so that a
+// busy link carries fewer, larger frames without ever blocking here.
+void report_edges() {
+    gk_listeners_execute();
+    if (num_edges && Serial.availableForWrite() - (int)tx_count
+            >= 2 + num_edges * EDGE_SIZE + (framing ? FRAME_OVERHEAD - 1 : 0))
+        send_edges();
+}
+
+// Send the input changes collected so far
+void send_edges() {
+    if (framing)
+        send_frame(EDGE_FRAME_SEQ, edge_frame + 1, 1 + num_edges * EDGE_SIZE);
+    else
+        tx_write_bytes(edge_frame, 2 + num_edges * EDGE_SIZE);
+    num_edges = 0;
+}
+
+// Encode samples from the sampler into the block being built, until there
+// are no more, or the block must be sent before the next one can go in
+void encode_samples() {
+    uint8_t width = gk_sampler_width();
+    while (true) {
+        if (!sample_held) {
+            if (!gk_sampler_read(sample_held_bytes, &sample_held_index))
+                return;
+            sample_held = true;
         }
-        if (!num_to_process) {
-            // We have now processed all of the delays
-            command_time_completed = command_time_last_scheduled;
-            step = 0;
-            return true;
+        if (sample_block_end && (sample_held_index != sample_next_index
+                || sample_block_end + 1u + width > sizeof(sample_block)))
+            return;
+        if (!sample_block_end) {
+            uint8_t* index = (uint8_t*)&sample_held_index;
+            for (uint8_t i = 0; i < 4; ++i)
+                sample_block[2 + i] = index[3 - i];
+            sample_block_end = 6;
+            sample_token = 0;
+            memset(sample_last, 0, sizeof(sample_last));
+            sample_block_deadline = gk_time_now() + gk_time_ms(SAMPLE_BLOCK_MS);
         }
-        // If there are still some to process, we remain on step 2 until all
-        // have been processed.
+
+        uint8_t changed = 0;
+        for (uint8_t i = 0; i < width; ++i) {
+            sample_held_bytes[i] ^= sample_last[i];
+            sample_last[i] ^= sample_held_bytes[i];
+            changed |= sample_held_bytes[i];
+        }
+        uint8_t* token = sample_token ? sample_block + sample_token : NULL;
+        if (!changed) {
+            if (token && *token < 0x7F) {
+                ++*token;
+            } else {
+                sample_token = sample_block_end;
+                sample_block[sample_block_end++] = 0x00;
+            }
+        } else {
+            if (token && (*token & 0x80) && *token < 0xFF) {
+                ++*token;
+            } else {
+                sample_token = sample_block_end;
+                sample_block[sample_block_end++] = 0x80;
+            }
+            memcpy(sample_block + sample_block_end, sample_held_bytes, width);
+            sample_block_end += width;
+        }
+        sample_next_index = sample_held_index + 1;
+        sample_held = false;
     }
-    return false;
 }
 
-bool cmd_config_input_pullup() {
-    uint8_t pin;
-    if (Serial.available()) {
-        pin = Serial.read();
-        gk_pin_set_mode(pin, GK_PIN_MODE_INPUT, GK_PIN_PULLUP_ON);
-        return true;
+// Send the block of samples built so far
+void send_samples() {
+    uint8_t length = sample_block_end - 2;
+    if (framing) {
+        sample_block[1] = SAMPLE_FRAME_MARK;
+        send_frame(EDGE_FRAME_SEQ, sample_block + 1, 1 + length);
+    } else {
+        sample_block[1] = length;
+        tx_write_bytes(sample_block, 2 + length);
     }
-    return false;
+    sample_block_end = 0;
+}
+
+// Stream samples to the host. A block is only sent once the output queue has
+// room for it, so that the main loop never waits on the serial link here;
+// meanwhile, samples wait in the sampler's buffer.
+void report_samples() {
+    encode_samples();
+    if (sample_block_end && (sample_held
+            || gk_time_after(gk_time_now(), sample_block_deadline))
+            && TX_QUEUE_SIZE - tx_count
+                >= sample_block_end + (framing ? FRAME_OVERHEAD - 1 : 0))
+        send_samples();
 }
 
-bool cmd_config_input_nopullup() {
-    uint8_t pin;
-    if (Serial.available()) {
-        pin = Serial.read();
-        gk_pin_set_mode(pin, GK_PIN_MODE_INPUT, GK_PIN_PULLUP_OFF);
-        return true;
+// Stop the sampler, and send every sample it has taken
+void flush_samples() {
+    gk_sampler_stop();
+    encode_samples();
+    while (sample_block_end) {
+        send_samples();
+        encode_samples();
+    }
+}
+
+// Run every command in serial input, in the raw protocol, as far as it has
+// arrived. Each command is taken to be received when its command byte is
+// read.
+void receive_commands() {
+    while (!framing && !data_rate_next && Serial.available()) {
+        if (command_state == COMMAND_IDLE) {
+            command_fine_received = gk_time_fine();
+            command_time_received = gk_time_now();
+        }
+        command_receive(Serial.read());
+    }
+}
+
+// Take the next byte of input for the command parser, running the command (or
+// its next item) as soon as all of it has arrived
+void command_receive(uint8_t value) {
+    if (command_state == COMMAND_IDLE) {
+        // A command byte; unknown commands are skipped
+        if (value >= num_commands)
+            return;
+        memcpy_P(&command, &commands[value], sizeof(command));
+        if (!command.run)
+            return;
+        // Until a new data rate is confirmed, input may be garbled by a
+        // mismatch in rates, so only its confirmation is accepted
+        if (data_rate_previous && command.run != cmd_confirm_data_rate)
+            return;
+        command_received = 0;
+        command_state = COMMAND_ARGS;
+    } else {
+        command_args[command_received++] = value;
+    }
+    if (command_state == COMMAND_ARGS) {
+        if (command_received < command.length)
+            return;
+        command_items = 0;
+        command.run(command_args);
+        command_state = COMMAND_ITEMS;
+    } else {
+        if (command_received < command.length + command.item_length)
+            return;
+        command.item(command_args, command_args + command.length);
+        --command_items;
+        command_received = command.length;
+    }
+    if (!command_items) {
+        if (command.end)
+            command.end(command_args, true);
+        command_state = COMMAND_IDLE;
     }
-    return false;
 }
 
-bool cmd_read_pin() {
-    uint8_t pin;
-    bool value;
-    if (Serial.available()) {
-        pin = Serial.read();
-        value = gk_pin_read(pin);
-        Serial.write(value);
-        return true;
+// Drop the command being received, the rest of which will never arrive
+void command_abandon() {
+    if (command_state == COMMAND_ITEMS && command.end)
+        command.end(command_args, false);
+    command_state = COMMAND_IDLE;
+}
+
+void count_frame_error() {
+#if GK_SCHEDULE_STATS
+    if (frame_errors < 0xFFFF)
+        ++frame_errors;
+#endif
+}
+
+// Read whatever serial input is available into the frame being received.
+// Returns true once a whole frame has arrived with a valid checksum; any
+// further input is left for the next call.
+bool receive_frame() {
+    while (Serial.available()) {
+        uint8_t value = Serial.read();
+        switch (frame_state) {
+        case FRAME_HUNT:
+            if (value == FRAME_SYNC) {
+                frame_fine_received = gk_time_fine();
+                frame_time_received = gk_time_now();
+                frame_state = FRAME_LENGTH;
+            }
+            break;
+        case FRAME_LENGTH:
+            if (value > FRAME_MAX_PAYLOAD) {
+                count_frame_error();
+                frame_state = FRAME_HUNT;
+                break;
+            }
+            frame_length = value;
+            frame_crc = 0;
+            gk_crc8_update(&frame_crc, value);
+            frame_state = FRAME_SEQ;
+            break;
+        case FRAME_SEQ:
+            frame_seq = value;
+            gk_crc8_update(&frame_crc, value);
+            frame_received = 0;
+            frame_state = frame_length ? FRAME_PAYLOAD : FRAME_CHECK;
+            break;
+        case FRAME_PAYLOAD:
+            frame_payload[frame_received++] = value;
+            gk_crc8_update(&frame_crc, value);
+            if (frame_received == frame_length)
+                frame_state = FRAME_CHECK;
+            break;
+        case FRAME_CHECK:
+            frame_state = FRAME_HUNT;
+            if (value == frame_crc)
+                return true;
+            count_frame_error();
+            break;
+        }
+    }
+    // Give up on a frame that has stopped arriving, since its length may have
+    // been corrupted
+    if (frame_state != FRAME_HUNT && gk_time_after(gk_time_now(),
+            frame_time_received + gk_time_ms(FRAME_TIMEOUT_MS))) {
+        count_frame_error();
+        frame_state = FRAME_HUNT;
     }
     return false;
 }
 
-bool cmd_get_clock() {
-    serial_write_bigendian(
-        (uint8_t*)&command_time_received,
-        sizeof(command_time_received)
-    );
+// Run each command in the frame just received, then answer it
+void run_frame() {
+    command_fine_received = frame_fine_received;
+    command_time_received = frame_time_received;
+    response_length = 0;
+    response_sent = false;
+    for (uint8_t i = 0; i < frame_length; ++i)
+        command_receive(frame_payload[i]);
+    // The frame may have ended partway through a command
+    command_abandon();
+    if (response_length || !response_sent)
+        send_frame(frame_seq, response_frame, response_length);
 }
 
-bool cmd_get_last_clock() {
-    serial_write_bigendian(
-        (uint8_t*)&command_time_initiated,
-        sizeof(command_time_initiated)
-    );
+void send_frame(uint8_t seq, uint8_t* payload, uint8_t length) {
+    uint8_t crc = 0;
+    gk_crc8_update(&crc, length);
+    gk_crc8_update(&crc, seq);
+    for (uint8_t i = 0; i < length; ++i)
+        gk_crc8_update(&crc, payload[i]);
+    tx_write(FRAME_SYNC);
+    tx_write(length);
+    tx_write(seq);
+    tx_write_bytes(payload, length);
+    tx_write(crc);
+}
+
+// Queue a byte of serial output. If the queue is full, this waits for the
+// serial port to take the oldest byte.
+void tx_write(uint8_t value) {
+    if (tx_count == TX_QUEUE_SIZE) {
+        Serial.write(tx_queue[tx_head]);
+        tx_head = (tx_head + 1) % TX_QUEUE_SIZE;
+        --tx_count;
+    }
+    tx_queue[(tx_head + tx_count) % TX_QUEUE_SIZE] = value;
+    ++tx_count;
 }
 
-bool cmd_get_schedule_size() {
-    Serial.write(gk_schedule_size());
+void tx_write_bytes(const uint8_t* data, uint8_t length) {
+    for (uint8_t i = 0; i < length; ++i)
+        tx_write(data[i]);
+}
+
+// Move as much queued output into the serial transmit buffer as it has room
+// for, without waiting
+void tx_flush() {
+    uint16_t room = Serial.availableForWrite();
+    while (tx_count && room) {
+        // Up to the end of the queued output, the room, or the end of the
+        // queue's storage, whichever comes first
+        uint16_t length = tx_count;
+        if (length > room)
+            length = room;
+        if (length > TX_QUEUE_SIZE - tx_head)
+            length = TX_QUEUE_SIZE - tx_head;
+        Serial.write(tx_queue + tx_head, length);
+        tx_head = (tx_head + length) % TX_QUEUE_SIZE;
+        tx_count -= length;
+        room -= length;
+    }
 }
 
-//bool cmd_start_listening();
-//bool cmd_stop_listening();
-//bool cmd_set_data_rate();
-//bool cmd_send_bytes();
-//bool cmd_send_clock();
+//void cmd_send_clock(const uint8_t* args);
 
 int serial_write_bigendian(uint8_t* value, int size) {
     for (int i = size-1; i >= 0; i--) {
-        Serial.write(value[i]);
+        response_write(value[i]);
     }
     return size;
 }
@@ -1,5 +1,17 @@
+import asyncio
+import collections
+import concurrent.futures
+import contextlib
+import threading
+import time
+
 import serial
 
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
 commands = [
     'config_output',
     'config_output_inverted',
@@ -13,6 +25,30 @@ commands = [
     'get_last_clock',
 
     'get_schedule_size',
+    'get_tick_period',
+    'cancel_pin',
+    'get_pin_schedule_size',
+    'start_listening',
+    'stop_listening',
+    'enable_framing',
+    'sync',
+    'write_at',
+    'pulse_at',
+    'pulse_train_at',
+    'generate_pulses',
+    'send_bytes',
+    'set_carrier',
+    'get_stats',
+    'reset_stats',
+    'set_data_rate',
+    'confirm_data_rate',
+    'read_all',
+    'set_debounce',
+    'start_sampling',
+    'stop_sampling',
+    'set_reflex',
+    'clear_reflex',
+    'get_reflex_count',
 ]
 
 msg_start = {
@@ -29,6 +65,380 @@ def convert_int(raw_bytes):
 def convert_time_ms(raw_bytes):
     return int.from_bytes(raw_bytes, byteorder='big')
 
+# Status of an absolute-time command: everything was scheduled, the time had
+# already passed, the schedule didn't have room, or the arguments were invalid
+# (in which case nothing was scheduled)
+SCHEDULE_OK = 0
+SCHEDULE_LATE = 1
+SCHEDULE_NO_ROOM = 2
+SCHEDULE_INVALID = 3
+
+def convert_frequency(raw_bytes):
+    return int.from_bytes(raw_bytes, byteorder='big') / 1000
+
+def convert_device_time(time):
+    return (int(time) % 2**32).to_bytes(4, byteorder='big')
+
+def convert_intervals(intervals):
+    """
+    Encode a pulse train's intervals (see EthIO.pulse_train) for the device:
+    returns the number of pulses and the intervals as 2-byte values.
+    `intervals` may be any sequence of numbers, including a NumPy array.
+    """
+    if numpy is not None:
+        values = numpy.asarray(intervals)
+        if values.ndim != 1:
+            raise ValueError('intervals must be one-dimensional')
+        if len(values) and (values.min() < 0 or values.max() > 0xFFFF):
+            raise ValueError('intervals must be from 0 to 65535 ms')
+        data = values.astype('>u2').tobytes()
+    else:
+        values = [int(interval) for interval in intervals]
+        if any(value < 0 or value > 0xFFFF for value in values):
+            raise ValueError('intervals must be from 0 to 65535 ms')
+        data = b''.join(value.to_bytes(2, byteorder='big') for value in values)
+    if len(values) % 2 != 1:
+        raise ValueError('intervals must have an odd length')
+    if len(values) > 2*255 - 1:
+        raise ValueError('too many pulses in one train')
+    return (len(values) + 1) // 2, data
+
+# While any pins are being listened to, every message from the device begins
+# with one of these tags
+RESPONSE_TAG = 0x01
+EDGES_TAG = 0x02
+EDGE_SIZE = 5
+
+InputEdge = collections.namedtuple('InputEdge', ['pin', 'level', 'time'])
+InputEdge.__doc__ = """
+A change of an input being listened to: `pin` went to `level` (True for high)
+at `time` on the device clock.
+"""
+
+# Most digital pins on any supported board (the Mega's 70)
+MAX_PINS = 70
+
+InputSnapshot = collections.namedtuple('InputSnapshot', ['time', 'levels'])
+InputSnapshot.__doc__ = """
+The levels of every input, read at once at `time` on the device clock (see
+EthIO.read_all). `levels` is a list of booleans (True for high), by pin.
+"""
+
+def convert_snapshot(num_pins):
+    def convert(raw_bytes):
+        bits = int.from_bytes(raw_bytes[4:], byteorder='little')
+        return InputSnapshot(
+            convert_time_ms(raw_bytes[:4]),
+            [bool(bits >> pin & 1) for pin in range(num_pins)],
+        )
+    return convert
+
+# Sampled inputs (see EthIO.start_sampling) arrive in blocks, tagged with
+# SAMPLES_TAG, or in frames with EDGE_FRAME_SEQ whose payload begins with
+# SAMPLE_FRAME_MARK
+SAMPLES_TAG = 0x03
+SAMPLE_FRAME_MARK = 0xFF
+# Fastest sampling rate, in Hz (GK_SAMPLER_MAX_RATE_MHZ on the device)
+SAMPLER_MAX_RATE = 20000
+# Position of a pin that can't be sampled
+NOT_SAMPLED = 0xFF
+
+InputSamples = collections.namedtuple(
+    'InputSamples', ['index', 'time', 'levels'])
+InputSamples.__doc__ = """
+Inputs sampled at a fixed rate (see EthIO.read_samples): sample `index[n]`
+was taken at `time[n]` on the device clock, and `levels[n]` holds the level of
+each pin sampled (True for high), in the order they were passed to
+start_sampling. With NumPy, these are arrays, `levels` having a row per
+sample; otherwise, lists. Numbers missing from `index` are samples the device
+dropped.
+"""
+
+class _Sampling:
+    """
+    What the host knows of the device's sampling: the pins asked for, and,
+    once start_sampling has been answered, the rate in millihertz, the time of
+    sample 0, the bytes in a sample, and where each pin is in one.
+    """
+    def __init__(self, pins, tick_period):
+        self.pins = list(pins)
+        self.tick_period = tick_period
+        self.rate_mhz = 0
+        self.start = 0
+        self.width = 0
+        self.positions = [NOT_SAMPLED] * len(self.pins)
+
+    def convert_start(self, raw_bytes):
+        self.rate_mhz = int.from_bytes(raw_bytes[:4], byteorder='big')
+        self.start = int.from_bytes(raw_bytes[4:8], byteorder='big')
+        self.width = raw_bytes[8]
+        self.positions = list(raw_bytes[9:])
+        return self.rate_mhz / 1000
+
+    def sample_ticks(self):
+        """
+        Device clock units between samples
+        """
+        return 10**12 / (self.rate_mhz * self.tick_period.result())
+
+# Input changes that fire a reflex rule (see EthIO.set_reflex); either or both
+REFLEX_RISING = 0x01
+REFLEX_FALLING = 0x02
+
+# Longest debounce filter, in samples (GK_DEBOUNCE_MAX_LENGTH on the device),
+# which are taken every millisecond by default
+DEBOUNCE_MAX_LENGTH = 16
+
+LATENESS_BUCKETS = 16
+STATS_SIZE = 40 + 2 * LATENESS_BUCKETS
+
+DeviceStats = collections.namedtuple('DeviceStats', [
+    'events', 'lateness_mean', 'lateness_max', 'lateness_histogram',
+    'loops', 'loop_mean', 'loop_max',
+    'peak_schedule_size', 'schedule_capacity',
+    'schedule_overflows', 'listener_overflows',
+    'rx_high_water', 'rx_buffer_size', 'frame_errors',
+])
+DeviceStats.__doc__ = """
+Timing statistics from the device (see EthIO.get_stats). Durations are in
+seconds. `lateness_histogram` is a list of (low, high, count) tuples: `count`
+events were executed at least `low` and less than `high` seconds late (`high`
+is None for the last bin). `lateness_mean` and `loop_mean` are None if nothing
+was measured.
+"""
+
+def convert_stats(raw_bytes):
+    def take(size):
+        nonlocal raw_bytes
+        value = int.from_bytes(raw_bytes[:size], byteorder='big')
+        raw_bytes = raw_bytes[size:]
+        return value
+    unit = take(4) * 1e-12
+    events, lateness_total, lateness_max = take(4), take(4), take(4)
+    histogram = []
+    for bucket in range(LATENESS_BUCKETS):
+        low = 0 if bucket == 0 else 2**(bucket - 1) * unit
+        high = 2**bucket * unit if bucket < LATENESS_BUCKETS - 1 else None
+        histogram.append((low, high, take(2)))
+    loops, loop_total, loop_max = take(4), take(4), take(4)
+    return DeviceStats(
+        events=events,
+        lateness_mean=lateness_total * unit / events if events else None,
+        lateness_max=lateness_max * unit,
+        lateness_histogram=histogram,
+        loops=loops,
+        loop_mean=loop_total * unit / loops if loops else None,
+        loop_max=loop_max * unit,
+        peak_schedule_size=take(1),
+        schedule_capacity=take(1),
+        schedule_overflows=take(2),
+        listener_overflows=take(2),
+        rx_high_water=take(2),
+        rx_buffer_size=take(2),
+        frame_errors=take(2),
+    )
+
+# How long the device waits at a new data rate for confirmation before going
+# back to the old one, in seconds (DATA_RATE_CONFIRM_MS in the sketch)
+DATA_RATE_CONFIRM_TIMEOUT = 0.25
+
+# Framed protocol: each frame is FRAME_SYNC <length> <seq> <payload> <crc>, and
+# the device sends input edges in frames with seq EDGE_FRAME_SEQ
+FRAMING_VERSION = 2
+FRAME_SYNC = 0xA5
+FRAME_OVERHEAD = 4
+EDGE_FRAME_SEQ = 0
+# Largest payload every board accepts (boards with more SRAM, such as the Mega,
+# accept up to 255 bytes)
+FRAME_MAX_PAYLOAD = 64
+
+def _crc8_table():
+    table = []
+    for value in range(256):
+        crc = 0
+        for _ in range(8):
+            mix = (crc ^ value) & 1
+            crc >>= 1
+            value >>= 1
+            if mix:
+                crc ^= 0x8C
+        table.append(crc)
+    return table
+
+_CRC8_TABLE = _crc8_table()
+
+def crc8(data, crc=0):
+    """
+    CRC8 of `data`, matching gk_crc8_update on the device.
+    """
+    for value in data:
+        crc = _CRC8_TABLE[crc ^ value]
+    return crc
+
+def make_frame(seq, payload):
+    header = bytes([len(payload), seq]) + bytes(payload)
+    return bytes([FRAME_SYNC]) + header + bytes([crc8(header)])
+
+def _device_time(fine_per_unit, fine, time):
+    """
+    A device clock reading, in device clock units, with the fraction of a unit
+    taken from the fine clock reading at the same moment. The fine clock wraps
+    around much sooner than the device clock, so it is only used for the
+    difference between the two, which is always small.
+    """
+    wrap = 2**32 / fine_per_unit
+    return time + ((fine / fine_per_unit - time + wrap / 2) % wrap - wrap / 2)
+
+class ClockSync:
+    """
+    Running estimate of how the device clock relates to a host clock, built up
+    from sync exchanges. Each exchange gives the host times just before the
+    request went out and just after the reply came back, and the device times
+    at which the request arrived and the reply was written. Exchanges delayed
+    on the link only ever make the round trip longer, so in each block of
+    `block` consecutive exchanges only the one with the shortest round trip is
+    kept, and the kept exchanges among the last `history` are fitted by least
+    squares to find the offset and rate of the device clock.
+
+    Device times are in device clock units (as from get_clock), and host times
+    are in seconds on the host clock used by the EthIO (time.perf_counter by
+    default).
+    """
+    def __init__(self, nominal_rate, history=256, block=8):
+        # nominal_rate: device clock units per second, from get_tick_period
+        self.nominal_rate = nominal_rate
+        self._samples = collections.deque(maxlen=history)
+        self._block = block
+        self._fit = None
+        self._lock = threading.Lock()
+
+    def add(self, host_sent, host_received, fine_per_unit,
+            fine_received, fine_replied, time_received, time_replied):
+        """
+        Add the result of one sync exchange.
+        """
+        with self._lock:
+            received = _device_time(fine_per_unit, fine_received, time_received)
+            replied = _device_time(fine_per_unit, fine_replied, time_replied)
+            replied = received + (replied - received) % 2**32
+            host = (host_sent + host_received) / 2
+            device = (received + replied) / 2
+            if self._samples:
+                # Keep counting past any wraparounds of the device clock since
+                # the last exchange, going by how long the host says it was
+                last_host, last_device = self._samples[-1][:2]
+                expected = last_device + (host - last_host) * self.nominal_rate
+                device = expected + (
+                    (device - expected + 2**31) % 2**32 - 2**31)
+            device_busy = (replied - received) / self.nominal_rate
+            self._samples.append((
+                host,
+                device,
+                host_received - host_sent - device_busy,
+            ))
+            self._refit()
+
+    def _refit(self):
+        samples = list(self._samples)
+        picks = [
+            min(samples[ind:ind + self._block], key=lambda s: s[2])
+            for ind in range(0, len(samples), self._block)
+        ]
+        host_mean = sum(s[0] for s in picks) / len(picks)
+        device_mean = sum(s[1] for s in picks) / len(picks)
+        sxx = sum((s[0] - host_mean)**2 for s in picks)
+        if len(picks) < 2 or sxx <= 0:
+            best = min(picks, key=lambda s: s[2])
+            self._fit = (best[0], best[1], self.nominal_rate)
+            return
+        sxy = sum(
+            (s[0] - host_mean) * (s[1] - device_mean) for s in picks)
+        self._fit = (host_mean, device_mean, sxy / sxx)
+
+    def _require_fit(self):
+        if self._fit is None:
+            raise NoResponseError
+        return self._fit
+
+    @property
+    def num_samples(self):
+        return len(self._samples)
+
+    @property
+    def rate(self):
+        """
+        Device clock units per host second.
+        """
+        return self._require_fit()[2]
+
+    @property
+    def drift(self):
+        """
+        How much faster the device clock runs than it should, relative to the
+        host clock, in parts per million.
+        """
+        return (self.rate / self.nominal_rate - 1) * 1e6
+
+    @property
+    def offset(self):
+        """
+        Device time minus host time, in seconds, as of the latest exchange.
+        """
+        host = self._samples[-1][0]
+        return self.to_device(host) / self.nominal_rate - host
+
+    @property
+    def rtt(self):
+        """
+        The shortest round trip among the recent exchanges, in seconds.
+        """
+        return min(s[2] for s in self._samples)
+
+    def to_device(self, host_time):
+        """
+        Convert a host time to device clock units. The result keeps counting
+        past the point where the device clock wraps around; take it modulo
+        2**32 to compare it with times read from the device.
+        """
+        host_ref, device_ref, rate = self._require_fit()
+        return device_ref + (host_time - host_ref) * rate
+
+    def to_host(self, device_time):
+        """
+        Convert a device time (as read from the device, or from to_device) to
+        host time. Device times that have wrapped around are taken to be the
+        ones nearest the latest exchange.
+        """
+        host_ref, device_ref, rate = self._require_fit()
+        ref = self._samples[-1][1]
+        device_time = ref + ((device_time - ref + 2**31) % 2**32 - 2**31)
+        return host_ref + (device_time - device_ref) / rate
+
+class _PendingFrame:
+    """
+    A frame sent to the device, waiting for the device's answer.
+    """
+    def __init__(self, seq, responders):
+        self.seq = seq
+        self.responders = responders
+        self.num_bytes = sum(r.num_bytes for r in responders)
+        self.data = bytearray()
+
+class _FramingSwitch:
+    """
+    Placeholder in the queue of responses, marking the point in the device's
+    output at which it starts sending frames.
+    """
+    pass
+
+class _TaggingSwitch:
+    """
+    Placeholder in the queue of responses, marking the point in the device's
+    output at which it starts (or stops) tagging messages.
+    """
+    def __init__(self, tagged):
+        self.tagged = tagged
+
 def require_ready(f):
     def _require_ready(self, *args, **kwargs):
         if not self._is_ready:
@@ -46,15 +456,38 @@ class NoResponseError(Exception):
     pass
 
 class EthIO:
-    def __init__(self, port=None, baudrate=115200, timeout=0.1):
+    def __init__(self, port=None, baudrate=115200, timeout=0.1,
+            clock=time.perf_counter):
         self._io = serial.Serial(
             port=port,
             baudrate=baudrate,
             timeout=timeout
         )
-        self._responders = []
+        self._responders = collections.deque()
         self._is_ready = False
         self._ready_message = ""
+        self._rx = bytearray()
+        self._tagged = False
+        self._listening = set()
+        self._edges = collections.deque()
+        self._sampling = None
+        self._sampling_rx = None
+        self._samples = collections.deque()
+        self._framing = False
+        self._framed_rx = False
+        self._max_payload = FRAME_MAX_PAYLOAD
+        self._batch = None
+        self._next_seq = 1
+        self._pending = collections.deque()
+        self.lost_frames = 0
+        self._clock = clock
+        self._lock = threading.RLock()
+        self.clock_sync = None
+        self._sync_thread = None
+        self._sync_interval = None
+        self._sync_stop = threading.Event()
+        self._reader_thread = None
+        self._reader_stop = threading.Event()
 
     @property
     def port(self):
@@ -67,10 +500,24 @@ class EthIO:
         self._io.open()
 
     def close(self):
+        self.stop_clock_sync()
+        self.stop_reader()
         self._io.close()
+        with self._lock:
+            self._abandon_responses()
         self._is_ready = False
         self._ready_message = ""
-        self._responders = []
+        self._responders = collections.deque()
+        self._rx = bytearray()
+        self._tagged = False
+        self._listening = set()
+        self._sampling = None
+        self._sampling_rx = None
+        self._samples = collections.deque()
+        self._framing = False
+        self._framed_rx = False
+        self._batch = None
+        self._pending = collections.deque()
 
     @property
     def is_open(self):
@@ -78,8 +525,8 @@ class EthIO:
 
     @property
     def is_ready(self):
-        if self._is_ready:
-            return True
+        if self._is_ready or self._reader_thread is not None:
+            return self._is_ready
         # Check if the device has reported in
         self._ready_message += self._io.read_until().decode()
         if self._ready_message and self._ready_message[-1] == "\n":
@@ -93,14 +540,14 @@ class EthIO:
         else:
             msg = msg_start['config_output']
         msg += pin.to_bytes(1, byteorder='big')
-        self._io.write(msg)
+        self._send(msg)
 
     @require_ready
     def pulse(self, pin, duration=10):
         msg = msg_start['pulse']
         msg += pin.to_bytes(1, byteorder='big')
         msg += duration.to_bytes(2, byteorder='big')
-        self._io.write(msg)
+        self._send(msg)
 
     @require_ready
     def pulse_after(self, pin, duration=10, delay=1):
@@ -108,11 +555,123 @@ class EthIO:
         msg += pin.to_bytes(1, byteorder='big')
         msg += delay.to_bytes(2, byteorder='big')
         msg += duration.to_bytes(2, byteorder='big')
-        self._io.write(msg)
+        self._send(msg)
 
     @require_ready
     def pulse_train(self, pin, intervals):
-        pass # Not yet implemented
+        """
+        Immediately start a series of pulses on output `pin`. `intervals` lists
+        the width of the first pulse, then the delay before and width of each
+        following pulse, in milliseconds, so it must have an odd length; it may
+        be a NumPy array.
+        """
+        count, data = convert_intervals(intervals)
+        msg = msg_start['pulse_train']
+        msg += pin.to_bytes(1, byteorder='big')
+        msg += count.to_bytes(1, byteorder='big')
+        msg += data
+        self._send(msg)
+
+    @require_ready
+    def write_at(self, pin, time, on=True):
+        """
+        Turn output `pin` on (or off) at `time` on the device clock. Returns an
+        EthIOResponse whose value is SCHEDULE_OK, SCHEDULE_LATE or
+        SCHEDULE_NO_ROOM.
+        """
+        msg = msg_start['write_at']
+        msg += pin.to_bytes(1, byteorder='big')
+        msg += bytes([1 if on else 0])
+        msg += convert_device_time(time)
+        return self._send(msg, EthIOResponse(self, 1, convert_int))
+
+    @require_ready
+    def pulse_at(self, pin, time, duration=10):
+        """
+        Pulse output `pin` for `duration` milliseconds, starting at `time` on
+        the device clock. Returns an EthIOResponse like write_at.
+        """
+        msg = msg_start['pulse_at']
+        msg += pin.to_bytes(1, byteorder='big')
+        msg += convert_device_time(time)
+        msg += duration.to_bytes(2, byteorder='big')
+        return self._send(msg, EthIOResponse(self, 1, convert_int))
+
+    @require_ready
+    def pulse_train_at(self, pin, time, intervals):
+        """
+        Send a series of pulses on output `pin`, the first starting at `time`
+        on the device clock. `intervals` lists the width of the first pulse,
+        then the delay before and width of each following pulse, in
+        milliseconds, so it must have an odd length; it may be a NumPy array.
+        Returns an EthIOResponse like write_at.
+        """
+        count, data = convert_intervals(intervals)
+        msg = msg_start['pulse_train_at']
+        msg += pin.to_bytes(1, byteorder='big')
+        msg += convert_device_time(time)
+        msg += count.to_bytes(1, byteorder='big')
+        msg += data
+        return self._send(msg, EthIOResponse(self, 1, convert_int))
+
+    @require_ready
+    def generate_pulses(self, pin, period, width, count=0, jitter=0,
+            delay=0):
+        """
+        Start a train of `count` pulses on output `pin` (endless, if `count`
+        is 0), each `width` ms long and beginning `period` ms after the last,
+        plus a random extra of up to `jitter` ms. The first begins `delay` ms
+        after the command arrives. The device generates the train one edge at
+        a time, so it takes constant memory on the device and only a few bytes
+        on the wire; stop it early with cancel_pin. Returns an EthIOResponse
+        whose value is SCHEDULE_OK, SCHEDULE_NO_ROOM if the device had no room
+        for it, or SCHEDULE_INVALID if `width` isn't less than `period` (for
+        more than one pulse).
+        """
+        msg = msg_start['generate_pulses']
+        msg += pin.to_bytes(1, byteorder='big')
+        for value in (delay, period, width, count, jitter):
+            msg += int(value).to_bytes(2, byteorder='big')
+        return self._send(msg, EthIOResponse(self, 1, convert_int))
+
+    @require_ready
+    def send_bytes(self, pin, data, bit_interval=2, bit_width=1,
+            checksum=True):
+        """
+        Immediately send `data` (up to 8 bytes, by default) on output `pin`
+        as a low-bitrate serial code: a 1-bit, then each bit of each byte
+        (least significant first), then a 1-bit, `bit_interval` ms apart, with
+        each 1-bit a `bit_width` ms pulse. If `checksum`, the CRC8 of `data`
+        (see crc8) follows as one more byte. Returns an EthIOResponse whose
+        value is SCHEDULE_OK, or SCHEDULE_NO_ROOM if the device couldn't send
+        it.
+        """
+        data = bytes(data)
+        msg = msg_start['send_bytes']
+        msg += pin.to_bytes(1, byteorder='big')
+        msg += bit_interval.to_bytes(2, byteorder='big')
+        msg += bit_width.to_bytes(2, byteorder='big')
+        msg += bytes([1 if checksum else 0, len(data)])
+        msg += data
+        return self._send(msg, EthIOResponse(self, 1, convert_int))
+
+    @require_ready
+    def set_carrier(self, pin, frequency, duty=0.5):
+        """
+        Modulate output `pin` on a carrier wave of `frequency` Hz, which is on
+        for a fraction `duty` of each cycle, or stop modulating it if
+        `frequency` is 0. The carrier is made by one of the device's hardware
+        timers, which is shared by its other pins, so they all get the same
+        frequency. Returns an EthIOResponse whose value is the frequency
+        actually produced, in Hz (to the nearest mHz), or 0 if the pin can't
+        be modulated.
+        """
+        duty = min(max(round(duty * 256), 0), 255)
+        msg = msg_start['set_carrier']
+        msg += pin.to_bytes(1, byteorder='big')
+        msg += round(frequency * 1000).to_bytes(4, byteorder='big')
+        msg += duty.to_bytes(1, byteorder='big')
+        return self._send(msg, EthIOResponse(self, 4, convert_frequency))
 
     @require_ready
     def config_input(self, pin, pullup=False):
@@ -121,44 +680,773 @@ class EthIO:
         else:
             msg = msg_start['config_input_nopullup']
         msg += pin.to_bytes(1, byteorder='big')
-        self._io.write(msg)
+        self._send(msg)
 
     @require_ready
     def read_pin(self, pin):
         msg = msg_start['read_pin']
         msg += pin.to_bytes(1, byteorder='big')
-        self._io.write(msg)
-        new_response = EthIOResponse(self, 1, convert_pin_input)
-        self._responders.append(new_response)
-        return new_response
+        return self._send(msg, EthIOResponse(self, 1, convert_pin_input))
+
+    @require_ready
+    def read_all(self, num_pins=MAX_PINS):
+        """
+        Read the levels of pins 0 to `num_pins`-1 all at once, as they are on
+        the hardware, whatever each pin is configured as. Returns an
+        EthIOResponse whose value is an InputSnapshot; pins the board doesn't
+        have read as low.
+        """
+        num_bytes = (num_pins + 7) // 8
+        msg = msg_start['read_all'] + num_bytes.to_bytes(1, byteorder='big')
+        return self._send(msg, EthIOResponse(
+            self, 4 + num_bytes, convert_snapshot(num_pins)))
+
+    @require_ready
+    def set_debounce(self, pin, length):
+        """
+        Debounce input `pin` on the device: a new level is only read, or
+        reported to listeners, once it has been seen in `length` samples in a
+        row (1 ms apart, by default), up to DEBOUNCE_MAX_LENGTH. A `length` of
+        0 stops debouncing the pin. Returns an EthIOResponse whose value is
+        True if it worked.
+        """
+        msg = msg_start['set_debounce']
+        msg += bytes([pin, length])
+        return self._send(msg, EthIOResponse(self, 1, convert_pin_input))
+
+    @require_ready
+    def set_reflex(self, rule, input_pin, output_pin, duration=10, delay=0,
+            count=1, period=0, edges=REFLEX_RISING, window=0, limit=0):
+        """
+        Set reflex `rule` on the device, replacing any rule already there: on
+        each change of `input_pin` in `edges` (REFLEX_RISING and/or
+        REFLEX_FALLING), `count` pulses of `duration` ms are scheduled on
+        `output_pin`, the first `delay` ms after the change, and each
+        beginning `period` ms after the last. This happens on the device with
+        no round trip to the host. If `window` is not 0, the rule only lasts
+        for `window` ms; if `limit` is not 0, it only fires `limit` times.
+        Rules are numbered from 0, with room for 4 (16 on boards with more
+        than 4 KB of SRAM). Returns an EthIOResponse whose value is True if
+        the rule was set.
+        """
+        msg = msg_start['set_reflex']
+        msg += bytes([rule, input_pin, edges, output_pin])
+        for value in (delay, duration, period, count, window):
+            msg += int(value).to_bytes(2, byteorder='big')
+        msg += bytes([limit])
+        return self._send(msg, EthIOResponse(self, 1, convert_pin_input))
+
+    @require_ready
+    def clear_reflex(self, rule):
+        """
+        Remove reflex `rule`. Returns an EthIOResponse whose value is the
+        number of times it fired.
+        """
+        msg = msg_start['clear_reflex'] + bytes([rule])
+        return self._send(msg, EthIOResponse(self, 2, convert_int))
+
+    @require_ready
+    def get_reflex_count(self, rule):
+        """
+        Get the number of times reflex `rule` has fired, whether or not it is
+        still in effect. Returns an EthIOResponse.
+        """
+        msg = msg_start['get_reflex_count'] + bytes([rule])
+        return self._send(msg, EthIOResponse(self, 2, convert_int))
 
     @require_ready
     def get_clock(self):
         msg = msg_start['get_clock']
-        self._io.write(msg)
-        new_response = EthIOResponse(self, 4, convert_time_ms)
-        self._responders.append(new_response)
-        return new_response
+        return self._send(msg, EthIOResponse(self, 4, convert_time_ms))
 
     @require_ready
     def get_last_clock(self):
         msg = msg_start['get_last_clock']
-        self._io.write(msg)
-        new_response = EthIOResponse(self, 4, convert_time_ms)
-        self._responders.append(new_response)
-        return new_response
+        return self._send(msg, EthIOResponse(self, 4, convert_time_ms))
 
     @require_ready
     def get_schedule_size(self):
         msg = msg_start['get_schedule_size']
-        self._io.write(msg)
-        new_response = EthIOResponse(self, 1, convert_int)
-        self._responders.append(new_response)
-        return new_response
+        return self._send(msg, EthIOResponse(self, 1, convert_int))
+
+    @require_ready
+    def cancel_pin(self, pin):
+        msg = msg_start['cancel_pin']
+        msg += pin.to_bytes(1, byteorder='big')
+        self._send(msg)
+
+    @require_ready
+    def get_pin_schedule_size(self, pin):
+        msg = msg_start['get_pin_schedule_size']
+        msg += pin.to_bytes(1, byteorder='big')
+        return self._send(msg, EthIOResponse(self, 1, convert_int))
+
+    @require_ready
+    def start_listening(self, pin):
+        msg = msg_start['start_listening']
+        msg += pin.to_bytes(1, byteorder='big')
+        with self._lock:
+            if not self._is_tagging() and not self._framing:
+                self._responders.append(_TaggingSwitch(True))
+            self._listening.add(pin)
+            return self._send(msg, EthIOResponse(self, 1, convert_pin_input))
+
+    @require_ready
+    def stop_listening(self, pin):
+        msg = msg_start['stop_listening']
+        msg += pin.to_bytes(1, byteorder='big')
+        with self._lock:
+            new_response = self._send(
+                msg, EthIOResponse(self, 1, convert_pin_input))
+            if pin in self._listening:
+                self._listening.remove(pin)
+                if not self._is_tagging() and not self._framing:
+                    self._responders.append(_TaggingSwitch(False))
+            return new_response
+
+    @require_ready
+    def start_sampling(self, pins, rate):
+        """
+        Sample input `pins` on the device at `rate` Hz (at most
+        SAMPLER_MAX_RATE), streaming every sample to the host; see
+        read_samples. Any sampling already under way is stopped first. Returns
+        an EthIOResponse whose value is the rate actually used, in Hz, or 0 if
+        sampling couldn't start. The device's Timer2 is taken over while it
+        samples, so its pins can't be modulated meanwhile.
+        """
+        pins = list(pins)
+        rate_mhz = round(rate * 1000)
+        if not pins or len(pins) > 255:
+            raise ValueError('from 1 to 255 pins can be sampled')
+        if rate_mhz <= 0 or rate > SAMPLER_MAX_RATE:
+            raise ValueError(
+                'rate must be up to {} Hz'.format(SAMPLER_MAX_RATE))
+        msg = msg_start['start_sampling']
+        msg += rate_mhz.to_bytes(4, byteorder='big')
+        msg += bytes([len(pins)] + pins)
+        with self._lock:
+            sampling = _Sampling(pins, self.get_tick_period())
+            if not self._is_tagging() and not self._framing:
+                self._responders.append(_TaggingSwitch(True))
+            self._sampling = sampling
+            return self._send(msg, EthIOResponse(
+                self, 9 + len(pins), self._sampling_started(sampling)))
+
+    @require_ready
+    def stop_sampling(self):
+        """
+        Stop sampling inputs. The samples still on the device are sent first,
+        and can be read with read_samples. Returns an EthIOResponse whose value
+        is the number of samples dropped by the device because the host didn't
+        take them quickly enough.
+        """
+        msg = msg_start['stop_sampling']
+        with self._lock:
+            new_response = self._send(msg, EthIOResponse(self, 2, convert_int))
+            if self._sampling is not None:
+                self._sampling = None
+                if not self._is_tagging() and not self._framing:
+                    self._responders.append(_TaggingSwitch(False))
+            return new_response
+
+    @require_ready
+    def read_samples(self):
+        """
+        Return the inputs sampled since the last call (see start_sampling), as
+        InputSamples, oldest first. Samples from before start_sampling was
+        called again are returned on their own, by an earlier call.
+        """
+        with self._lock:
+            self._pump()
+            runs = []
+            while (self._samples and (not runs
+                    or self._samples[0][0] is runs[0][0])):
+                runs.append(self._samples.popleft())
+        if not runs:
+            if numpy is not None:
+                return InputSamples(numpy.zeros(0, dtype=numpy.int64),
+                    numpy.zeros(0, dtype=numpy.int64),
+                    numpy.zeros((0, 0), dtype=bool))
+            return InputSamples([], [], [])
+        sampling = runs[0][0]
+        ticks = sampling.sample_ticks()
+        positions = sampling.positions
+        if numpy is None:
+            index = []
+            levels = []
+            for _, first, count, sample in runs:
+                row = [pos != NOT_SAMPLED
+                    and bool(sample[pos // 8] >> (pos % 8) & 1)
+                    for pos in positions]
+                index.extend(range(first, first + count))
+                levels.extend(list(row) for _ in range(count))
+            time = [(sampling.start + round(ind * ticks)) % 2**32
+                for ind in index]
+            return InputSamples(index, time, levels)
+        firsts = numpy.array([run[1] for run in runs], dtype=numpy.int64)
+        counts = numpy.array([run[2] for run in runs], dtype=numpy.int64)
+        data = numpy.frombuffer(b''.join(run[3] for run in runs),
+            dtype=numpy.uint8).reshape(len(runs), sampling.width)
+        # Each run's first index, plus the position within the run
+        offsets = numpy.repeat(numpy.cumsum(counts) - counts, counts)
+        index = (numpy.repeat(firsts, counts)
+            + numpy.arange(counts.sum()) - offsets)
+        time = (sampling.start
+            + numpy.rint(index * ticks).astype(numpy.int64)) % 2**32
+        levels = numpy.zeros((len(runs), len(positions)), dtype=bool)
+        for col, pos in enumerate(positions):
+            if pos != NOT_SAMPLED:
+                levels[:, col] = data[:, pos // 8] >> (pos % 8) & 1
+        return InputSamples(index, time, numpy.repeat(levels, counts, axis=0))
+
+    def _sampling_started(self, sampling):
+        # The samples that follow the response to start_sampling are its own
+        def convert(raw_bytes):
+            self._sampling_rx = sampling
+            return sampling.convert_start(raw_bytes)
+        return convert
+
+    def _is_tagging(self):
+        """
+        Whether the device tags its output (with the raw protocol)
+        """
+        return bool(self._listening) or self._sampling is not None
+
+    @require_ready
+    def enable_framing(self, max_payload=FRAME_MAX_PAYLOAD):
+        """
+        Switch the device to the framed protocol, until it is reset. Commands
+        are then sent in checksummed frames, several at once inside a `with
+        ethio.batch():` block, and any number of them may be in flight. A frame
+        that is corrupted on the way is ignored by the device, and the
+        responses it would have carried are marked defunct (and counted in
+        `lost_frames`) once a later frame is answered. `max_payload` is the
+        largest frame payload the device accepts.
+        """
+        if self._framing:
+            return None
+        msg = msg_start['enable_framing']
+        with self._lock:
+            # Sent right away, even inside a batch() block, since the commands
+            # after it have to go in frames
+            new_response = self._send_locked(
+                msg, EthIOResponse(self, 1, convert_int), immediate=True)
+            self._responders.append(_FramingSwitch())
+            self._framing = True
+            self._max_payload = max_payload
+            return new_response
+
+    @contextlib.contextmanager
+    def batch(self):
+        """
+        Within this block, commands issued on this thread are collected and
+        sent together when the block ends: in a single write with the raw
+        protocol, or in as few frames as possible after enable_framing.
+        """
+        with self._lock:
+            if self._batch is not None:
+                nested = True
+            else:
+                nested = False
+                self._batch = (bytearray(), [])
+                self._batch_thread = threading.get_ident()
+        if nested:
+            yield
+            return
+        try:
+            yield
+        finally:
+            with self._lock:
+                self._flush_batch()
+                self._batch = None
+
+    # The earlier name of batch(), from when it only worked with framing
+    frame = batch
+
+    def _send(self, msg, response=None):
+        """
+        Send a command, and register the response expected to it, if any.
+        """
+        with self._lock:
+            return self._send_locked(msg, response)
+
+    def _send_locked(self, msg, response, immediate=False):
+        # immediate: send now, even inside a batch() block (after the commands
+        # collected so far, with the raw protocol)
+        responders = [response] if response is not None else []
+        batching = (self._batch is not None
+            and self._batch_thread == threading.get_ident())
+        if not self._framing:
+            # Responses arrive in the order the commands were issued, whenever
+            # they are actually written
+            self._responders.extend(responders)
+            if not batching:
+                if self._batch is not None:
+                    # Another thread's batch goes first, having been issued
+                    # first
+                    self._flush_batch()
+                self._io.write(msg)
+                return response
+            self._batch[0].extend(msg)
+            if immediate:
+                self._flush_batch()
+            return response
+        if len(msg) > self._max_payload:
+            raise ValueError('Command too long to fit in a frame')
+        if immediate or not batching:
+            self._send_frame(msg, responders)
+            return response
+        if len(self._batch[0]) + len(msg) > self._max_payload:
+            self._flush_batch()
+        payload, batched = self._batch
+        payload += msg
+        batched += responders
+        return response
+
+    def _flush_batch(self):
+        """
+        Send the commands collected so far in a batch() block.
+        """
+        payload, responders = self._batch
+        self._batch = (bytearray(), [])
+        if not payload:
+            return
+        if self._framing:
+            self._send_frame(payload, responders)
+        else:
+            self._io.write(payload)
+
+    def _send_frame(self, payload, responders):
+        # Sequence numbers cycle through 1-255, so at most 254 frames can be
+        # in flight before an answer could be mistaken for another's
+        self._pump()
+        if len(self._pending) >= 254:
+            raise NoResponseError
+        seq = self._next_seq
+        self._next_seq = seq % 255 + 1
+        self._pending.append(_PendingFrame(seq, responders))
+        self._io.write(make_frame(seq, payload))
+
+    def _abandon_responses(self):
+        """
+        Give up on every response still expected from the device.
+        """
+        for responder in self._responders:
+            if isinstance(responder, EthIOResponse):
+                responder._abandon()
+        for pending in self._pending:
+            for responder in pending.responders:
+                responder._abandon()
+        self._responders = collections.deque(
+            r for r in self._responders if not isinstance(r, EthIOResponse))
+        self._pending = collections.deque()
+        self._rx = bytearray()
+
+    @require_ready
+    def set_data_rate(self, rate, timeout=1.0):
+        """
+        Switch the serial link to `rate` bits per second, e.g. 500000, 1000000
+        or 2000000 on a 16 MHz board. Waits up to `timeout` seconds for the
+        device to answer everything already sent, then asks it to switch,
+        switches the serial port once it agrees, and confirms the new rate
+        with it; if that fails, both sides go back to the old rate. Returns
+        the rate the device's UART actually runs at, or 0 if the rate wasn't
+        changed. Other threads must not use the device meanwhile; clock sync
+        and the reader thread are paused.
+        """
+        old_rate = self._io.baudrate
+        sync_interval = self._sync_interval if self._sync_thread else None
+        reader = self._reader_thread is not None
+        self.stop_clock_sync()
+        self.stop_reader()
+        try:
+            with self._lock:
+                return self._set_data_rate(rate, old_rate, timeout)
+        finally:
+            if reader:
+                self.start_reader()
+            if sync_interval is not None:
+                self.start_clock_sync(sync_interval)
+
+    def _set_data_rate(self, rate, old_rate, timeout):
+        deadline = time.monotonic() + timeout
+        while any(isinstance(r, EthIOResponse) for r in self._responders) \
+                or self._pending:
+            if time.monotonic() > deadline:
+                raise NoResponseError
+            self._pump()
+            time.sleep(0.001)
+        msg = msg_start['set_data_rate']
+        msg += int(rate).to_bytes(4, byteorder='big')
+        response = self._send_locked(
+            msg, EthIOResponse(self, 4, convert_int), immediate=True)
+        achieved = response.result(max(deadline - time.monotonic(), 0))
+        if not achieved:
+            return 0
+        # The device switches as soon as its answer has gone out
+        self._io.baudrate = rate
+        self._io.reset_input_buffer()
+        if self._confirm_data_rate(rate):
+            return achieved
+        # Unless the confirmation got through and only its answer was lost,
+        # the device goes back to the old rate by itself
+        time.sleep(DATA_RATE_CONFIRM_TIMEOUT)
+        self._io.baudrate = old_rate
+        self._io.reset_input_buffer()
+        if self._confirm_data_rate(old_rate):
+            return 0
+        self._io.baudrate = rate
+        self._io.reset_input_buffer()
+        if self._confirm_data_rate(rate):
+            return achieved
+        raise NoResponseError
+
+    def _confirm_data_rate(self, rate):
+        """
+        Check that the device is running at `rate`, confirming a change to it.
+        """
+        msg = msg_start['confirm_data_rate']
+        msg += int(rate).to_bytes(4, byteorder='big')
+        response = self._send_locked(
+            msg, EthIOResponse(self, 1, convert_int), immediate=True)
+        try:
+            if response.result(DATA_RATE_CONFIRM_TIMEOUT / 2) == 1:
+                return True
+        except (NoResponseError, concurrent.futures.TimeoutError):
+            pass
+        # Garbled or missing, so nothing else from the device can be trusted
+        self._abandon_responses()
+        return False
+
+    @property
+    def listening(self):
+        return frozenset(self._listening)
+
+    @require_ready
+    def read_edges(self):
+        """
+        Return a list of the InputEdges received from the device since the last
+        call, oldest first.
+        """
+        with self._lock:
+            self._pump()
+            edges = list(self._edges)
+            self._edges.clear()
+            return edges
+
+    def _pump(self):
+        """
+        Read whatever the device has sent, and sort it out into responses and
+        input edges.
+        """
+        with self._lock:
+            self._pump_locked()
+
+    def _pump_locked(self):
+        # The reader thread, if running, is the only one to read the port
+        if self._reader_thread is None:
+            waiting = self._io.in_waiting
+            if waiting:
+                self._rx += self._io.read(waiting)
+        self._parse()
+
+    def _parse(self):
+        while True:
+            while (self._responders and isinstance(
+                    self._responders[0], (_TaggingSwitch, _FramingSwitch))):
+                switch = self._responders.popleft()
+                if isinstance(switch, _FramingSwitch):
+                    self._framed_rx = True
+                else:
+                    self._tagged = switch.tagged
+            if self._framed_rx:
+                self._pump_frames()
+                return
+            if self._tagged:
+                if not self._rx:
+                    return
+                if self._rx[0] == EDGES_TAG:
+                    if len(self._rx) < 2:
+                        return
+                    frame_size = 2 + self._rx[1] * EDGE_SIZE
+                    if len(self._rx) < frame_size:
+                        return
+                    self._add_edges(self._rx[1:frame_size])
+                    del self._rx[:frame_size]
+                    continue
+                if self._rx[0] == SAMPLES_TAG:
+                    if len(self._rx) < 2:
+                        return
+                    frame_size = 2 + self._rx[1]
+                    if len(self._rx) < frame_size:
+                        return
+                    self._add_samples(self._rx[2:frame_size])
+                    del self._rx[:frame_size]
+                    continue
+                offset = 1
+            else:
+                offset = 0
+            if not self._responders:
+                return
+            responder = self._responders[0]
+            if len(self._rx) < offset + responder.num_bytes:
+                return
+            responder._resolve(
+                bytes(self._rx[offset:offset + responder.num_bytes]))
+            del self._rx[:offset + responder.num_bytes]
+            self._responders.popleft()
+
+    @require_ready
+    def sync(self):
+        """
+        Run one sync exchange with the device, adding it to `clock_sync` once
+        the reply arrives. Returns an EthIOResponse whose value is a tuple of
+        (fine clock units per clock unit, fine time received, fine time
+        replied, time received, time replied), as sent by the device.
+        Normally start_clock_sync is more convenient.
+        """
+        if self.clock_sync is None:
+            period = self.get_tick_period()
+            self.clock_sync = ClockSync(1e9 / period.result())
+        msg = msg_start['sync']
+        response = _SyncResponse(self)
+        with self._lock:
+            # Sent right away, even inside a batch() block
+            response.host_sent = self._clock()
+            self._send_locked(msg, response, immediate=True)
+        return response
+
+    def start_clock_sync(self, interval=1.0):
+        """
+        Keep `clock_sync` up to date from a background thread, running a sync
+        exchange every `interval` seconds until stop_clock_sync or close.
+        """
+        if self._sync_thread is not None:
+            return
+        self._sync_interval = interval
+        self._sync_stop.clear()
+        self._sync_thread = threading.Thread(
+            target=self._sync_loop, args=(interval,), daemon=True)
+        self._sync_thread.start()
+
+    def stop_clock_sync(self):
+        if self._sync_thread is None:
+            return
+        self._sync_stop.set()
+        self._sync_thread.join()
+        self._sync_thread = None
+
+    def _sync_loop(self, interval):
+        while not self._sync_stop.is_set():
+            try:
+                response = self.sync()
+            except NoResponseError:
+                response = None
+            # Watch closely for the reply, since the time it arrives is what
+            # is being measured
+            deadline = self._clock() + 1.0
+            while (response is not None and not response.is_ready
+                    and not response._is_defunct
+                    and self._clock() < deadline
+                    and not self._sync_stop.is_set()):
+                time.sleep(0.0001)
+            self._sync_stop.wait(interval)
+
+    def start_reader(self):
+        """
+        Read from the device on a background thread from now until stop_reader
+        or close, so that responses are filled in (and their callbacks run) and
+        input edges collected as soon as they arrive, without polling. This
+        includes the READY message, so it may be started straight after
+        opening the connection.
+        """
+        if self._reader_thread is not None:
+            return
+        self._reader_stop.clear()
+        with self._lock:
+            self._reader_thread = threading.Thread(
+                target=self._read_loop, daemon=True)
+            self._reader_thread.start()
+
+    def stop_reader(self):
+        if self._reader_thread is None:
+            return
+        self._reader_stop.set()
+        # Wake the reader if it's waiting for data, where supported;
+        # otherwise it notices within the port's timeout
+        cancel_read = getattr(self._io, 'cancel_read', None)
+        if cancel_read is not None:
+            cancel_read()
+        self._reader_thread.join()
+        with self._lock:
+            self._reader_thread = None
+
+    def _read_loop(self):
+        while not self._reader_stop.is_set():
+            try:
+                data = self._io.read(max(1, self._io.in_waiting))
+            except (serial.SerialException, OSError):
+                if not self._io.is_open:
+                    return
+                raise
+            if not data:
+                continue
+            with self._lock:
+                if not self._is_ready:
+                    data = self._take_ready_message(data)
+                self._rx += data
+                self._parse()
+
+    def _take_ready_message(self, data):
+        """
+        Move the READY message from the start of `data`, the first read from
+        the device, into _ready_message, and return the rest.
+        """
+        end = data.find(b'\n')
+        if end < 0:
+            self._ready_message += data.decode(errors='replace')
+            return b''
+        self._ready_message += data[:end + 1].decode(errors='replace')
+        self._is_ready = True
+        return data[end + 1:]
+
+    def to_host_time(self, device_time):
+        """
+        Convert a device time to host time, using `clock_sync`.
+        """
+        if self.clock_sync is None:
+            raise NoResponseError
+        return self.clock_sync.to_host(device_time)
+
+    def to_device_time(self, host_time):
+        """
+        Convert a host time to device time, using `clock_sync`.
+        """
+        if self.clock_sync is None:
+            raise NoResponseError
+        return self.clock_sync.to_device(host_time)
+
+    def _pump_frames(self):
+        while True:
+            start = self._rx.find(FRAME_SYNC)
+            if start < 0:
+                self._rx.clear()
+                return
+            del self._rx[:start]
+            if len(self._rx) < 2:
+                return
+            frame_size = self._rx[1] + FRAME_OVERHEAD
+            if len(self._rx) < frame_size:
+                return
+            if crc8(self._rx[1:frame_size-1]) != self._rx[frame_size-1]:
+                # Corrupted, or not really the start of a frame; look for the
+                # next one from just after this sync byte
+                del self._rx[:1]
+                continue
+            seq = self._rx[2]
+            payload = bytes(self._rx[3:frame_size-1])
+            del self._rx[:frame_size]
+            if seq == EDGE_FRAME_SEQ:
+                if payload[:1] == bytes([SAMPLE_FRAME_MARK]):
+                    self._add_samples(payload[1:])
+                else:
+                    self._add_edges(payload)
+            else:
+                self._receive_answer(seq, payload)
+
+    def _receive_answer(self, seq, payload):
+        # Frames are answered in the order they were sent, so any frames
+        # still waiting ahead of this one were lost
+        while self._pending and self._pending[0].seq != seq:
+            lost = self._pending.popleft()
+            self.lost_frames += 1
+            for responder in lost.responders:
+                responder._abandon()
+        if not self._pending:
+            return
+        pending = self._pending[0]
+        pending.data += payload
+        if len(pending.data) < pending.num_bytes:
+            # The rest of the answer follows in another frame
+            return
+        self._pending.popleft()
+        offset = 0
+        for responder in pending.responders:
+            responder._resolve(
+                bytes(pending.data[offset:offset + responder.num_bytes]))
+            offset += responder.num_bytes
+
+    def _add_edges(self, data):
+        """
+        Unpack a list of input edges: <count> [<pin> <time>]*
+        """
+        for ind in range(1, 1 + data[0] * EDGE_SIZE, EDGE_SIZE):
+            self._edges.append(InputEdge(
+                data[ind] & 0x7F,
+                bool(data[ind] & 0x80),
+                convert_time_ms(data[ind+1:ind+EDGE_SIZE]),
+            ))
+
+    def _add_samples(self, data):
+        """
+        Unpack a block of samples: <index> [<token>]*, each token being a run
+        of repeats of the last sample (0nnnnnnn), or of samples XORed with the
+        one before (1nnnnnnn [<byte>]*), n+1 long
+        """
+        sampling = self._sampling_rx
+        if sampling is None:
+            return
+        width = sampling.width
+        index = int.from_bytes(data[:4], byteorder='big')
+        sample = bytes(width)
+        pos = 4
+        while pos < len(data):
+            token = data[pos]
+            count = (token & 0x7F) + 1
+            pos += 1
+            if not token & 0x80:
+                self._samples.append((sampling, index, count, sample))
+                index += count
+                continue
+            for _ in range(count):
+                sample = bytes(
+                    a ^ b for a, b in zip(sample, data[pos:pos+width]))
+                pos += width
+                self._samples.append((sampling, index, 1, sample))
+                index += 1
+
+    @require_ready
+    def get_tick_period(self):
+        msg = msg_start['get_tick_period']
+        return self._send(msg, EthIOResponse(self, 4, convert_int))
+
+    @require_ready
+    def get_stats(self):
+        """
+        Get the device's timing statistics since startup or the last
+        reset_stats: how late scheduled events were executed, how long its
+        main loop takes, and how close its schedule and buffers came to
+        filling up. Returns an EthIOResponse whose value is a DeviceStats.
+        """
+        msg = msg_start['get_stats']
+        return self._send(msg, EthIOResponse(self, STATS_SIZE, convert_stats))
+
+    @require_ready
+    def reset_stats(self):
+        """
+        Start gathering the device's timing statistics afresh.
+        """
+        msg = msg_start['reset_stats']
+        self._send(msg)
 
-# Not sure this is the best way to implement this; seems a bit sketchy to let
-# the EthIOResponse control the EthIO's queue and its siblings.
 class EthIOResponse:
+    """
+    A response the device will send to a command. Besides polling `is_ready`,
+    it can be used like a concurrent.futures.Future (result, done,
+    add_done_callback, or `future` for a real one), or awaited in a coroutine.
+    Waiting is most efficient with the EthIO's reader thread running (see
+    EthIO.start_reader); otherwise the waiting thread reads from the device.
+    """
     def __init__(self, ethio, num_bytes, converter):
         self.ethio = ethio
         self.num_bytes = num_bytes
@@ -167,41 +1455,142 @@ class EthIOResponse:
         self._value = None
         self._is_ready = False
         self._is_defunct = False
+        self._done = threading.Event()
+        self._callbacks = []
 
     @property
     def is_ready(self):
-        if self._is_ready:
-            return True
-        if self._is_defunct:
-            return False
-        try:
-            while self.ethio._responders[0] is not self:
-                # There are other EthIOReponses queued ahead of this one. Check
-                # if the first one in the queue is ready until we either find
-                # one that's not, or we exhaust the queue ahead of this one.
-                if not self.ethio._responders[0].is_ready:
-                    return False
-        except IndexError:
-            # If we hit this, it means we made it to the end of the _responders
-            # queue without encountering this EthIOResponse. That means
-            # something went wrong (maybe the connection was closed) and this
-            # EthIOResponse is defunct.
-            self._is_defunct = True
-            return False
-        # This EthIOResponse is the next in the queue. Check if it's available.
-        bytes_remaining = self.num_bytes - len(self.raw_data)
-        self.raw_data += self.ethio._io.read(bytes_remaining)
-        if len(self.raw_data) == self.num_bytes:
-            # We have now read the entire reply for this one
-            self._value = self.converter(self.raw_data)
-            self._is_ready = True
-            self.ethio._responders.pop(0)
-            return True
-        else:
-            # There is still data remaining to be read
-            return False
+        if not self._is_ready and not self._is_defunct:
+            # Let the EthIO read whatever has arrived; it fills in responses
+            # (this one, and any ahead of it) in the order they were requested.
+            self.ethio._pump()
+        return self._is_ready
+
+    def _resolve(self, raw_data):
+        self.raw_data = raw_data
+        self._value = self.converter(raw_data)
+        self._is_ready = True
+        self._finish()
+
+    def _abandon(self):
+        """
+        Give up on this response: the device will never send it.
+        """
+        self._is_defunct = True
+        self._finish()
+
+    def _finish(self):
+        self._done.set()
+        callbacks, self._callbacks = self._callbacks, []
+        for callback in callbacks:
+            callback(self)
 
     @property
     @require_ready
     def value(self):
         return self._value
+
+    def done(self):
+        """
+        True once the response has arrived, or will never arrive.
+        """
+        return self.is_ready or self._is_defunct
+
+    def result(self, timeout=None):
+        """
+        Wait up to `timeout` seconds (or for as long as it takes, if None) for
+        the response, and return its value. Raises NoResponseError if the
+        response will never arrive, or concurrent.futures.TimeoutError if it
+        hasn't arrived in time.
+        """
+        deadline = None if timeout is None else time.monotonic() + timeout
+        while not self.is_ready:
+            if self._is_defunct:
+                raise NoResponseError
+            wait = None
+            if deadline is not None:
+                wait = deadline - time.monotonic()
+                if wait <= 0:
+                    raise concurrent.futures.TimeoutError
+            if self.ethio._reader_thread is None:
+                # Nothing else is reading the device, so check back soon
+                wait = 0.001 if wait is None else min(wait, 0.001)
+            self._done.wait(wait)
+        return self._value
+
+    def add_done_callback(self, callback):
+        """
+        Call `callback(response)` once the response has arrived, or will never
+        arrive: right away if that has already happened, and otherwise on the
+        thread that reads it from the device, which must not block for long.
+        """
+        with self.ethio._lock:
+            if not self._done.is_set():
+                self._callbacks.append(callback)
+                return
+        callback(self)
+
+    @property
+    def future(self):
+        """
+        A concurrent.futures.Future that completes with this response.
+        """
+        future = concurrent.futures.Future()
+        future.set_running_or_notify_cancel()
+        def complete(response):
+            if response._is_ready:
+                future.set_result(response._value)
+            else:
+                future.set_exception(NoResponseError())
+        self.add_done_callback(complete)
+        return future
+
+    def __await__(self):
+        if self.ethio._reader_thread is not None:
+            return asyncio.wrap_future(self.future).__await__()
+        return self._poll().__await__()
+
+    async def _poll(self):
+        while not self.is_ready:
+            if self._is_defunct:
+                raise NoResponseError
+            await asyncio.sleep(0.001)
+        return self._value
+
+def convert_sync(raw_bytes):
+    return (
+        convert_int(raw_bytes[0:2]),
+        convert_int(raw_bytes[2:6]),
+        convert_int(raw_bytes[6:10]),
+        convert_int(raw_bytes[10:14]),
+        convert_int(raw_bytes[14:18]),
+    )
+
+class _SyncResponse(EthIOResponse):
+    """
+    Response to a sync exchange, which feeds its result to the EthIO's
+    ClockSync when it arrives.
+    """
+    def __init__(self, ethio):
+        super().__init__(ethio, 18, convert_sync)
+        self.host_sent = None
+
+    def _resolve(self, raw_data):
+        host_received = self.ethio._clock()
+        value = self.converter(raw_data)
+        # Allow for the time to send the first byte of the request (when the
+        # device takes its reading) and the whole of the reply, which the
+        # device's readings don't cover
+        byte_time = 10 / self.ethio._io.baudrate
+        reply_size = self.num_bytes
+        if self.ethio._framed_rx:
+            reply_size += FRAME_OVERHEAD
+        elif self.ethio._tagged:
+            reply_size += 1
+        self.ethio.clock_sync.add(
+            self.host_sent + byte_time,
+            host_received - reply_size * byte_time,
+            *value
+        )
+        # Only now let anyone waiting know, so they see the updated clock_sync
+        super()._resolve(raw_data)
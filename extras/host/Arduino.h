@@ -0,0 +1,212 @@
+/* Arduino.h
+Stand-in for the Arduino core, for building gkutil on a desktop machine (see
+CMakeLists.txt in this directory). It describes an ATmega328P board (the Uno):
+20 digital pins on ports B, C and D, and Timers 0, 1 and 2. The I/O registers
+are plain memory at their ATmega328P data addresses, so code under test can
+write and read them as on the device, and inspect them afterwards; nothing
+happens in hardware, e.g. a timer never counts and interrupts only run when
+their vector is called directly (ISR(v) defines an ordinary function v).
+
+millis() and micros() read a simulated clock, which only moves when it is set
+or advanced with gk_host_set_micros and gk_host_advance_micros.
+*/
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+#define RAMEND 0x8FF
+#define NUM_DIGITAL_PINS 20
+
+// Simulated I/O registers, by data address
+extern volatile uint8_t gk_host_io[0x100];
+#define _SFR_MEM8(addr) (gk_host_io[addr])
+#define _SFR_MEM16(addr) (*(volatile uint16_t *)&gk_host_io[addr])
+
+// Simulated clock, in microseconds since startup
+void gk_host_set_micros(uint64_t us);
+void gk_host_advance_micros(uint32_t us);
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+#define PINB _SFR_MEM8(0x23)
+#define DDRB _SFR_MEM8(0x24)
+#define PORTB _SFR_MEM8(0x25)
+#define PINC _SFR_MEM8(0x26)
+#define DDRC _SFR_MEM8(0x27)
+#define PORTC _SFR_MEM8(0x28)
+#define PIND _SFR_MEM8(0x29)
+#define DDRD _SFR_MEM8(0x2A)
+#define PORTD _SFR_MEM8(0x2B)
+#define TIFR0 _SFR_MEM8(0x35)
+#define TIFR1 _SFR_MEM8(0x36)
+#define TIFR2 _SFR_MEM8(0x37)
+#define PCIFR _SFR_MEM8(0x3B)
+#define TCCR0A _SFR_MEM8(0x44)
+#define TCCR0B _SFR_MEM8(0x45)
+#define TCNT0 _SFR_MEM8(0x46)
+#define OCR0A _SFR_MEM8(0x47)
+#define OCR0B _SFR_MEM8(0x48)
+#define SREG _SFR_MEM8(0x5F)
+#define PCICR _SFR_MEM8(0x68)
+#define PCMSK0 _SFR_MEM8(0x6B)
+#define PCMSK1 _SFR_MEM8(0x6C)
+#define PCMSK2 _SFR_MEM8(0x6D)
+#define TIMSK0 _SFR_MEM8(0x6E)
+#define TIMSK1 _SFR_MEM8(0x6F)
+#define TIMSK2 _SFR_MEM8(0x70)
+#define TCCR1A _SFR_MEM8(0x80)
+#define TCCR1B _SFR_MEM8(0x81)
+#define TCCR1C _SFR_MEM8(0x82)
+#define TCNT1 _SFR_MEM16(0x84)
+#define ICR1 _SFR_MEM16(0x86)
+#define OCR1A _SFR_MEM16(0x88)
+#define OCR1B _SFR_MEM16(0x8A)
+#define TCCR2A _SFR_MEM8(0xB0)
+#define TCCR2B _SFR_MEM8(0xB1)
+#define TCNT2 _SFR_MEM8(0xB2)
+#define OCR2A _SFR_MEM8(0xB3)
+#define OCR2B _SFR_MEM8(0xB4)
+#define UCSR0A _SFR_MEM8(0xC0)
+#define UCSR0B _SFR_MEM8(0xC1)
+#define UCSR0C _SFR_MEM8(0xC2)
+#define UBRR0 _SFR_MEM16(0xC4)
+#define UDR0 _SFR_MEM8(0xC6)
+
+// Register bits
+#define WGM00 0
+#define WGM01 1
+#define WGM02 3
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define COM0B1 5
+#define COM0A1 7
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1A 1
+#define OCF1B 2
+#define WGM20 0
+#define WGM21 1
+#define COM2B0 4
+#define COM2B1 5
+#define COM2A0 6
+#define COM2A1 7
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM22 3
+#define OCIE2A 1
+#define OCF2A 1
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define U2X0 1
+
+#define _BV(bit) (1 << (bit))
+#define cli() (SREG &= (uint8_t)~0x80)
+#define sei() (SREG |= 0x80)
+
+// Interrupt vectors; ISR(v) defines a function that can be called to simulate
+// the interrupt
+#define ISR(vector) void vector(void)
+#define PCINT0_vect PCINT0_vect
+#define PCINT1_vect PCINT1_vect
+#define PCINT2_vect PCINT2_vect
+#define TIMER1_COMPA_vect TIMER1_COMPA_vect
+#define TIMER1_COMPB_vect TIMER1_COMPB_vect
+#define TIMER2_COMPA_vect TIMER2_COMPA_vect
+
+// Program memory is ordinary memory on the host
+#define PROGMEM
+#define PGM_P const char *
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr) (*(void *const *)(addr))
+#define memcpy_P memcpy
+
+// Pin layout, numbered as in the Arduino core
+#define NOT_A_PIN 0
+#define NOT_A_PORT 0
+#define PA 1
+#define PB 2
+#define PC 3
+#define PD 4
+
+#define NOT_ON_TIMER 0
+#define TIMER0A 1
+#define TIMER0B 2
+#define TIMER1A 3
+#define TIMER1B 4
+#define TIMER1C 5
+#define TIMER2 6
+#define TIMER2A 7
+#define TIMER2B 8
+#define TIMER3A 9
+#define TIMER3B 10
+#define TIMER3C 11
+#define TIMER4A 12
+#define TIMER4B 13
+#define TIMER4C 14
+#define TIMER4D 15
+#define TIMER5A 16
+#define TIMER5B 17
+#define TIMER5C 18
+
+extern const uint8_t gk_host_pin_to_port[NUM_DIGITAL_PINS];
+extern const uint8_t gk_host_pin_to_bit_mask[NUM_DIGITAL_PINS];
+extern const uint8_t gk_host_pin_to_timer[NUM_DIGITAL_PINS];
+extern volatile uint8_t *const gk_host_port_to_output[5];
+extern volatile uint8_t *const gk_host_port_to_input[5];
+extern volatile uint8_t *const gk_host_port_to_mode[5];
+
+#define digitalPinToPort(p) (gk_host_pin_to_port[p])
+#define digitalPinToBitMask(p) (gk_host_pin_to_bit_mask[p])
+#define digitalPinToTimer(p) (gk_host_pin_to_timer[p])
+#define portOutputRegister(p) (gk_host_port_to_output[p])
+#define portInputRegister(p) (gk_host_port_to_input[p])
+#define portModeRegister(p) (gk_host_port_to_mode[p])
+
+#define digitalPinToPCICR(p) \
+    (((p) >= 0 && (p) <= 21) ? (&PCICR) : ((volatile uint8_t *)0))
+#define digitalPinToPCICRbit(p) (((p) <= 7) ? 2 : (((p) <= 13) ? 0 : 1))
+#define digitalPinToPCMSK(p) \
+    (((p) <= 7) ? (&PCMSK2) : (((p) <= 13) ? (&PCMSK0) : \
+    (((p) <= 21) ? (&PCMSK1) : ((volatile uint8_t *)0))))
+#define digitalPinToPCMSKbit(p) \
+    (((p) <= 7) ? (p) : (((p) <= 13) ? ((p) - 8) : ((p) - 14)))
+
+typedef uint8_t byte;
+#define word(h, l) ((uint16_t)(((h) << 8) | (l)))
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define highByte(w) ((uint8_t)((w) >> 8))
+
+#ifdef __cplusplus
+}
+#endif
+#endif //ifndef ARDUINO_H
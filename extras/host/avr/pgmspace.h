@@ -0,0 +1,2 @@
+// Stand-in for <avr/pgmspace.h>; everything it provides is in Arduino.h
+#include <Arduino.h>
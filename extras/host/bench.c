@@ -0,0 +1,381 @@
+/* bench.c
+Microbenchmarks for gkutil, run on the host against the stand-in Arduino.h.
+
+Each benchmark times one operation at a time and reports its throughput (from
+the mean time), median and mean times, and 99th-percentile and worst times,
+after subtracting the cost of
+reading the host clock. Very cheap operations are repeated within each timing,
+so their times are averages over the repeats. Host times only show relative
+costs (and changes in them); on an AVR everything takes far longer.
+
+Usage: gkutil_bench [--quick] [--baseline FILE] [--tolerance PERCENT]
+
+--quick runs fewer rounds, e.g. as a smoke test. --baseline compares the
+median times, which are little affected by the host being interrupted, with
+those in FILE, which holds earlier output of this program, and exits with
+status 1 if any is more than PERCENT (default 25) percent slower.
+The program exits with status 2 if the library misbehaves while being
+measured.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <Arduino.h>
+#include <gkutil.h>
+#include <gkutil/schedule.h>
+#include <gkutil/debounce.h>
+#include <gkutil/sampler.h>
+
+// Pin used for the operations being measured; other events go on the others
+#define BENCH_PIN 13
+#define FILL_PINS 11 // pins 2 to 12
+
+typedef struct Benchmark {
+    const char *name;
+    uint8_t depth;          // events in the schedule while measuring
+    uint16_t repeat;        // operations per timing
+    uint16_t bytes;         // bytes processed per operation, for throughput
+    void (*before)(void);   // untimed, before each timing
+    void (*op)(void);
+    void (*after)(void);    // untimed, after each timing
+} Benchmark;
+
+typedef struct Result {
+    double median_ns;
+    double mean_ns;
+    double p99_ns;
+    double max_ns;
+} Result;
+
+static uint32_t random_state = 2463534242u;
+
+static uint32_t bench_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void fail(const char *message) {
+    fprintf(stderr, "gkutil_bench: %s\n", message);
+    exit(2);
+}
+
+// Events far enough in the future that they never come due while measuring
+static gkTime future_time(void) {
+    return gk_time_now() + gk_time_ms(1000000) + bench_random() % 1000;
+}
+
+// Empty the schedule and fill it with depth events on pins other than
+// BENCH_PIN
+static void fill_schedule(uint8_t depth) {
+    for (gkPin pin = 0; pin < GK_NUM_PINS; ++pin)
+        gk_schedule_cancel_pin(pin);
+    for (uint8_t ind = 0; ind < depth; ++ind) {
+        if (gk_schedule_add(future_time(), 2 + ind % FILL_PINS,
+                GK_PIN_WRITE_TOGGLE) == GK_SCHEDULE_FULL)
+            fail("schedule filled up early");
+    }
+}
+
+static void check_depth(uint8_t depth) {
+    if (gk_schedule_size() != depth)
+        fail("schedule has the wrong number of events");
+}
+
+static void nothing(void) {}
+
+static void op_schedule_add(void) {
+    if (gk_schedule_add(future_time(), BENCH_PIN, GK_PIN_WRITE_TOGGLE)
+            == GK_SCHEDULE_FULL)
+        fail("no room to add an event");
+}
+
+static void cancel_bench_pin(void) {
+    if (gk_schedule_cancel_pin(BENCH_PIN) != 1)
+        fail("added event went missing");
+}
+
+static void add_due_event(void) {
+    if (gk_schedule_add(gk_time_now(), BENCH_PIN, GK_PIN_WRITE_TOGGLE)
+            == GK_SCHEDULE_FULL)
+        fail("no room to add an event");
+}
+
+static void op_schedule_execute(void) {
+    gk_schedule_execute();
+}
+
+static void check_executed(void) {
+    if (gk_schedule_pin_size(BENCH_PIN))
+        fail("due event was not executed");
+}
+
+static void op_pin_write(void) {
+    gk_pin_write(BENCH_PIN, GK_PIN_WRITE_TOGGLE);
+}
+
+static void op_pin_write_simple(void) {
+    gk_pin_write_simple(BENCH_PIN, GK_PIN_WRITE_TOGGLE);
+}
+
+static void op_port_register(void) {
+    PINB = _BV(5);
+}
+
+// Where input levels go, so that reading them isn't optimized away
+static volatile uint8_t levels_read;
+
+static void op_pin_read_each(void) {
+    uint8_t levels = 0;
+    for (gkPin pin = 0; pin < GK_NUM_PINS; ++pin)
+        levels ^= gk_pin_read(pin);
+    levels_read = levels;
+}
+
+static void op_ports_snapshot(void) {
+    gkPortsSnapshot snapshot;
+    gk_ports_snapshot(&snapshot);
+    levels_read = snapshot.pins[0];
+}
+
+// Make a debounce sample due, with the inputs bouncing
+static void bounce_inputs(void) {
+    gk_host_advance_micros(GK_DEBOUNCE_PERIOD_US);
+    PINB ^= (uint8_t)bench_random();
+    PINC ^= (uint8_t)bench_random();
+    PIND ^= (uint8_t)bench_random();
+}
+
+static void op_debounce_update(void) {
+    gk_debounce_update();
+}
+
+// The sampler's interrupt, as the host build defines it
+void TIMER2_COMPA_vect(void);
+
+// Take a sample and read it back, as the interrupt and main loop would
+static void op_sampler_take_read(void) {
+    uint8_t sample[GK_NUM_PORTS];
+    uint32_t index;
+    TIMER2_COMPA_vect();
+    if (!gk_sampler_read(sample, &index))
+        fail("sample went missing");
+    levels_read = sample[0];
+}
+
+static uint8_t crc_data[1024];
+static uint8_t crc;
+
+static void op_crc8(void) {
+    for (uint16_t ind = 0; ind < sizeof(crc_data); ++ind)
+        gk_crc8_update(&crc, crc_data[ind]);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time an empty operation, to subtract from the other timings
+static double clock_overhead_ns(void) {
+    double best = 1e9;
+    for (int ind = 0; ind < 10000; ++ind) {
+        uint64_t start = now_ns();
+        uint64_t end = now_ns();
+        if (end - start < best)
+            best = (double)(end - start);
+    }
+    return best;
+}
+
+static Result run(const Benchmark *bench, unsigned rounds, double overhead) {
+    double *times = malloc(rounds * sizeof(double));
+    if (!times)
+        fail("out of memory");
+    fill_schedule(bench->depth);
+    double total = 0;
+    for (unsigned round = 0; round < rounds; ++round) {
+        bench->before();
+        uint64_t start = now_ns();
+        for (uint16_t ind = 0; ind < bench->repeat; ++ind)
+            bench->op();
+        uint64_t end = now_ns();
+        bench->after();
+        double time = ((double)(end - start) - overhead) / bench->repeat;
+        times[round] = time > 0 ? time : 0;
+        total += times[round];
+    }
+    check_depth(bench->depth);
+    qsort(times, rounds, sizeof(double), compare_doubles);
+    Result result = {
+        times[rounds / 2],
+        total / rounds,
+        times[rounds * 99 / 100],
+        times[rounds - 1],
+    };
+    free(times);
+    return result;
+}
+
+// Find a benchmark's median time in the output of an earlier run
+static bool baseline_median(FILE *file, const char *name, double *median) {
+    char line[256];
+    rewind(file);
+    while (fgets(line, sizeof(line), file)) {
+        char *tab = strchr(line, '\t');
+        if (line[0] == '#' || !tab)
+            continue;
+        *tab = '\0';
+        if (strcmp(line, name))
+            continue;
+        return sscanf(tab + 1, "%*s %*s %lf", median) == 1;
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    unsigned rounds = 20000;
+    const char *baseline_path = NULL;
+    double tolerance = 25;
+    for (int arg = 1; arg < argc; ++arg) {
+        if (!strcmp(argv[arg], "--quick")) {
+            rounds = 1000;
+        } else if (!strcmp(argv[arg], "--baseline") && arg + 1 < argc) {
+            baseline_path = argv[++arg];
+        } else if (!strcmp(argv[arg], "--tolerance") && arg + 1 < argc) {
+            tolerance = atof(argv[++arg]);
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [--baseline FILE] "
+                    "[--tolerance PERCENT]\n", argv[0]);
+            return 2;
+        }
+    }
+    FILE *baseline = NULL;
+    if (baseline_path && !(baseline = fopen(baseline_path, "r"))) {
+        perror(baseline_path);
+        return 2;
+    }
+
+    gk_setup();
+    gk_schedule_setup();
+    gk_host_set_micros(1000000);
+    for (gkPin pin = 0; pin < GK_NUM_PINS; ++pin) {
+        gk_pin_configure_simple(pin);
+        gk_pin_set_mode(pin, GK_PIN_MODE_OUTPUT, GK_PIN_WRITE_OFF);
+    }
+    for (uint16_t ind = 0; ind < sizeof(crc_data); ++ind)
+        crc_data[ind] = bench_random();
+    // Debounce every pin, on all three ports, with a spread of lengths
+    gk_debounce_setup();
+    for (gkPin pin = 0; pin < GK_NUM_PINS; ++pin)
+        gk_debounce_set(pin, 1 + pin % GK_DEBOUNCE_MAX_LENGTH);
+    // Sample a pin on each of the three ports, at 1 kHz
+    gk_sampler_clear_pins();
+    gk_sampler_add_pin(2);
+    gk_sampler_add_pin(8);
+    gk_sampler_add_pin(14);
+    if (!gk_sampler_start(1000000))
+        fail("sampler didn't start");
+    uint8_t sample[GK_NUM_PORTS];
+    uint32_t index;
+    while (gk_sampler_read(sample, &index))
+        ;
+
+    // Schedule depths to measure at: empty, a quarter, half and (nearly) full
+    const uint8_t depths[] = {
+        0, SCHEDULE_BUFFER_SIZE / 4, SCHEDULE_BUFFER_SIZE / 2,
+        SCHEDULE_BUFFER_SIZE - 1,
+    };
+    const uint8_t num_depths = sizeof(depths) / sizeof(depths[0]);
+    Benchmark benchmarks[3 * sizeof(depths) / sizeof(depths[0]) + 8];
+    uint8_t num_benchmarks = 0;
+    for (uint8_t ind = 0; ind < num_depths; ++ind) {
+        benchmarks[num_benchmarks++] = (Benchmark){
+            "schedule_add", depths[ind], 1, 0,
+            nothing, op_schedule_add, cancel_bench_pin,
+        };
+    }
+    for (uint8_t ind = 0; ind < num_depths; ++ind) {
+        benchmarks[num_benchmarks++] = (Benchmark){
+            "schedule_execute", depths[ind], 1, 0,
+            add_due_event, op_schedule_execute, check_executed,
+        };
+    }
+    for (uint8_t ind = 0; ind < num_depths; ++ind) {
+        benchmarks[num_benchmarks++] = (Benchmark){
+            "schedule_execute_idle", depths[ind], 100, 0,
+            nothing, op_schedule_execute, nothing,
+        };
+    }
+    benchmarks[num_benchmarks++] = (Benchmark){
+        "pin_write", 0, 100, 0, nothing, op_pin_write, nothing,
+    };
+    benchmarks[num_benchmarks++] = (Benchmark){
+        "pin_write_simple", 0, 100, 0, nothing, op_pin_write_simple, nothing,
+    };
+    benchmarks[num_benchmarks++] = (Benchmark){
+        "port_register", 0, 100, 0, nothing, op_port_register, nothing,
+    };
+    benchmarks[num_benchmarks++] = (Benchmark){
+        "pin_read_each", 0, 10, 0, nothing, op_pin_read_each, nothing,
+    };
+    benchmarks[num_benchmarks++] = (Benchmark){
+        "ports_snapshot", 0, 10, 0, nothing, op_ports_snapshot, nothing,
+    };
+    benchmarks[num_benchmarks++] = (Benchmark){
+        "debounce_update", 0, 1, 0,
+        bounce_inputs, op_debounce_update, nothing,
+    };
+    benchmarks[num_benchmarks++] = (Benchmark){
+        "sampler_take_read", 0, 100, 0,
+        nothing, op_sampler_take_read, nothing,
+    };
+    benchmarks[num_benchmarks++] = (Benchmark){
+        "crc8_1KiB", 0, 1, sizeof(crc_data), nothing, op_crc8, nothing,
+    };
+
+    double overhead = clock_overhead_ns();
+    printf("# gkutil host benchmarks: %u rounds, clock overhead %.0f ns\n",
+            rounds, overhead);
+    printf("# name\tops/s\tMB/s\tmedian_ns\tmean_ns\tp99_ns\tmax_ns\n");
+    int status = 0;
+    for (uint8_t ind = 0; ind < num_benchmarks; ++ind) {
+        const Benchmark *bench = &benchmarks[ind];
+        char name[64];
+        if (bench->op == op_schedule_add || bench->op == op_schedule_execute)
+            snprintf(name, sizeof(name), "%s/%u", bench->name, bench->depth);
+        else
+            snprintf(name, sizeof(name), "%s", bench->name);
+
+        Result result = run(bench, rounds, overhead);
+        double ops = result.mean_ns > 0 ? 1e9 / result.mean_ns : 0;
+        printf("%s\t%.0f\t", name, ops);
+        if (bench->bytes)
+            printf("%.1f\t", ops * bench->bytes / 1e6);
+        else
+            printf("-\t");
+        printf("%.1f\t%.1f\t%.1f\t%.1f\n", result.median_ns, result.mean_ns,
+                result.p99_ns, result.max_ns);
+
+        double old_median;
+        if (baseline && baseline_median(baseline, name, &old_median)
+                && result.median_ns > old_median * (1 + tolerance / 100)) {
+            fprintf(stderr, "regression: %s took %.1f ns, baseline %.1f ns\n",
+                    name, result.median_ns, old_median);
+            status = 1;
+        }
+    }
+    if (baseline)
+        fclose(baseline);
+    return status;
+}
@@ -0,0 +1,71 @@
+// Simulated ATmega328P board state for the host build; see Arduino.h
+
+#include <Arduino.h>
+
+volatile uint8_t gk_host_io[0x100];
+
+// Interrupts start out enabled, as after the Arduino core's init()
+__attribute__((constructor)) static void host_init(void) {
+    sei();
+}
+
+// Microseconds since startup; micros() and millis() wrap around separately,
+// as on the device
+static uint64_t clock_us = 0;
+
+void gk_host_set_micros(uint64_t us) {
+    clock_us = us;
+}
+
+void gk_host_advance_micros(uint32_t us) {
+    clock_us += us;
+}
+
+unsigned long micros(void) {
+    return (uint32_t)clock_us;
+}
+
+unsigned long millis(void) {
+    return (uint32_t)(clock_us / 1000);
+}
+
+void delay(unsigned long ms) {
+    clock_us += ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us) {
+    clock_us += us;
+}
+
+const uint8_t gk_host_pin_to_port[NUM_DIGITAL_PINS] = {
+    PD, PD, PD, PD, PD, PD, PD, PD,
+    PB, PB, PB, PB, PB, PB,
+    PC, PC, PC, PC, PC, PC,
+};
+
+const uint8_t gk_host_pin_to_bit_mask[NUM_DIGITAL_PINS] = {
+    _BV(0), _BV(1), _BV(2), _BV(3), _BV(4), _BV(5), _BV(6), _BV(7),
+    _BV(0), _BV(1), _BV(2), _BV(3), _BV(4), _BV(5),
+    _BV(0), _BV(1), _BV(2), _BV(3), _BV(4), _BV(5),
+};
+
+const uint8_t gk_host_pin_to_timer[NUM_DIGITAL_PINS] = {
+    NOT_ON_TIMER, NOT_ON_TIMER, NOT_ON_TIMER, TIMER2B,
+    NOT_ON_TIMER, TIMER0B, TIMER0A, NOT_ON_TIMER,
+    NOT_ON_TIMER, TIMER1A, TIMER1B, TIMER2A,
+    NOT_ON_TIMER, NOT_ON_TIMER,
+    NOT_ON_TIMER, NOT_ON_TIMER, NOT_ON_TIMER, NOT_ON_TIMER, NOT_ON_TIMER,
+    NOT_ON_TIMER,
+};
+
+volatile uint8_t *const gk_host_port_to_output[5] = {
+    NOT_A_PORT, NOT_A_PORT, &PORTB, &PORTC, &PORTD,
+};
+
+volatile uint8_t *const gk_host_port_to_input[5] = {
+    NOT_A_PORT, NOT_A_PORT, &PINB, &PINC, &PIND,
+};
+
+volatile uint8_t *const gk_host_port_to_mode[5] = {
+    NOT_A_PORT, NOT_A_PORT, &DDRB, &DDRC, &DDRD,
+};
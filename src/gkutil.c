@@ -3,8 +3,117 @@
 #include "gkutil.h"
 #undef GKUTIL_GLOBAL
 
+#if GK_TIME_BASE == GK_TIME_TICK
+volatile gkTime gk_tick_count = 0;
+
+ISR(TIMER1_COMPA_vect) {
+    ++gk_tick_count;
+}
+
+gkTime gk_time_ticks(void) {
+    uint8_t SREG_orig = SREG;
+    cli();
+    gkTime ticks = gk_tick_count;
+    SREG = SREG_orig;
+    return ticks;
+}
+#endif
+
 void gk_setup(void) {
-    // We don't actually need to do anything here
+#if GK_TIME_BASE == GK_TIME_TICK
+    // Timer1 in CTC mode with OCR1A as TOP, prescaled by 8
+    uint8_t SREG_orig = SREG;
+    cli();
+    TCCR1A = 0;
+    TCCR1B = _BV(WGM12) | _BV(CS11);
+    TCNT1 = 0;
+    OCR1A = GK_TIME_TICK_TOP;
+    TIFR1 = _BV(OCF1A);
+    TIMSK1 |= _BV(OCIE1A);
+    SREG = SREG_orig;
+#endif
+}
+
+uint32_t gk_time_period_ns(void) {
+    return GK_TIME_PERIOD_NS;
+}
+
+uint32_t gk_time_fine(void) {
+#if GK_TIME_BASE == GK_TIME_TICK
+    uint8_t SREG_orig = SREG;
+    cli();
+    uint32_t ticks = gk_tick_count;
+    uint16_t count = TCNT1;
+    // If the counter has just reset, the tick may not have been counted yet
+    if ((TIFR1 & _BV(OCF1A)) && count < GK_TIME_TICK_TOP / 2)
+        ++ticks;
+    SREG = SREG_orig;
+    return ticks * (GK_TIME_TICK_TOP + 1) + count;
+#else
+    return micros();
+#endif
+}
+
+GK_PIN_DRIVER(
+    gk_pin_driver_simple,
+    gk_pin_set_mode_simple,
+    gk_pin_write_simple,
+    gk_pin_read_simple
+);
+
+// Drivers in use, by index: from 1 to GK_PIN_MAX_DRIVERS - 1, in program
+// memory, with the simple driver always at GK_PIN_DRIVER_SIMPLE; then the
+// custom drivers, in SRAM
+const gkPinDriver* gk_pin_driver_list[GK_PIN_MAX_DRIVERS] = {
+    0, &gk_pin_driver_simple,
+};
+gkPinDriver gk_pin_custom_drivers[GK_PIN_CUSTOM_DRIVERS];
+
+// Whether any pin uses driver index, so that its slot can be reused
+static bool driver_in_use(uint8_t index) {
+    for (gkPin pin = 0; pin < GK_NUM_PINS; ++pin) {
+        if ((gk_pin_drivers[pin] & GK_PIN_DRIVER_INDEX) == index)
+            return true;
+    }
+    return false;
+}
+
+static void set_driver_index(gkPin pin, uint8_t index) {
+    gk_pin_drivers[pin] = (gk_pin_drivers[pin] & ~GK_PIN_DRIVER_INDEX) | index;
+}
+
+// Record whether the driver now at index writes with gk_pin_write_simple
+static void set_simple_writer(uint8_t index, gkPinWriter* writer) {
+    if (writer == gk_pin_write_simple)
+        gk_pin_simple_writers[index / 8] |= 1 << (index % 8);
+    else
+        gk_pin_simple_writers[index / 8] &= ~(1 << (index % 8));
+}
+
+bool gk_pin_set_driver(gkPin pin, const gkPinDriver* driver) {
+    if (pin >= GK_NUM_PINS)
+        return false;
+    if (!driver) {
+        set_driver_index(pin, GK_PIN_DRIVER_NONE);
+        return true;
+    }
+    uint8_t free = 0;
+    for (uint8_t index = GK_PIN_DRIVER_SIMPLE; index < GK_PIN_MAX_DRIVERS;
+            ++index) {
+        if (gk_pin_driver_list[index] == driver) {
+            set_driver_index(pin, index);
+            return true;
+        }
+        if (!free && index != GK_PIN_DRIVER_SIMPLE
+                && (!gk_pin_driver_list[index] || !driver_in_use(index)))
+            free = index;
+    }
+    if (!free)
+        return false;
+    gk_pin_driver_list[free] = driver;
+    set_simple_writer(free, (gkPinWriter*)pgm_read_ptr(&driver->write));
+    set_driver_index(pin, free);
+    return true;
 }
 
 void gk_pin_configure(
@@ -13,37 +122,122 @@ void gk_pin_configure(
     gkPinWriter *writer,
     gkPinReader *reader
 ) {
-    gk_pin_mode_setters[pin] = setter;
-    gk_pin_writers[pin] = writer;
-    gk_pin_readers[pin] = reader;
+    if (pin >= GK_NUM_PINS)
+        return;
+    if (!setter && !writer && !reader) {
+        set_driver_index(pin, GK_PIN_DRIVER_NONE);
+        return;
+    }
+    gkPinDriver wanted = {setter, writer, reader};
+    for (uint8_t index = GK_PIN_DRIVER_SIMPLE; index < GK_PIN_MAX_DRIVERS;
+            ++index) {
+        gkPinDriver driver;
+        if (!gk_pin_driver_list[index])
+            continue;
+        memcpy_P(&driver, gk_pin_driver_list[index], sizeof(driver));
+        if (!memcmp(&driver, &wanted, sizeof(driver))) {
+            set_driver_index(pin, index);
+            return;
+        }
+    }
+    // A custom slot is only rewritten once no pin uses it, in case a write
+    // from an interrupt is using it meanwhile
+    uint8_t free = 0;
+    for (uint8_t slot = 0; slot < GK_PIN_CUSTOM_DRIVERS; ++slot) {
+        uint8_t index = GK_PIN_MAX_DRIVERS + slot;
+        if (!memcmp(&gk_pin_custom_drivers[slot], &wanted, sizeof(wanted))) {
+            set_driver_index(pin, index);
+            return;
+        }
+        if (!free && !driver_in_use(index))
+            free = index;
+    }
+    if (!free)
+        return;
+    gk_pin_custom_drivers[free - GK_PIN_MAX_DRIVERS] = wanted;
+    set_simple_writer(free, writer);
+    set_driver_index(pin, free);
+}
+
+bool gk_pin_get_driver(gkPin pin, gkPinDriver* driver) {
+    if (pin >= GK_NUM_PINS)
+        return false;
+    uint8_t index = gk_pin_drivers[pin] & GK_PIN_DRIVER_INDEX;
+    if (index >= GK_PIN_MAX_DRIVERS)
+        *driver = gk_pin_custom_drivers[index - GK_PIN_MAX_DRIVERS];
+    else if (index)
+        memcpy_P(driver, gk_pin_driver_list[index], sizeof(*driver));
+    else
+        return false;
+    return true;
 }
-/*
-void gk_pin_configure_simple(gkPin pin) {
-    gk_pin_set_mode_setter(pin, &gk_pin_set_mode_simple);
-    gk_pin_set_writer(pin, &gk_pin_write_simple);
-    gk_pin_set_reader(pin, &gk_pin_read_simple);
+
+void gk_pin_set_inverted(gkPin pin, bool inverted) {
+    if (pin >= GK_NUM_PINS)
+        return;
+    if (inverted)
+        gk_pin_drivers[pin] |= GK_PIN_INVERTED;
+    else
+        gk_pin_drivers[pin] &= ~GK_PIN_INVERTED;
 }
 
-void gk_pin_configure_disabled(gkPin pin) {
-    gk_pin_set_mode_setter(pin, (void*)0);
-    gk_pin_set_writer(pin, (void*)0);
-    gk_pin_set_reader(pin, (void*)0);
+// The action that an active-low pin takes for action
+static gkPinAction invert_action(gkPinAction action) {
+    if (action == GK_PIN_WRITE_ON)
+        return GK_PIN_WRITE_OFF;
+    if (action == GK_PIN_WRITE_OFF)
+        return GK_PIN_WRITE_ON;
+    return action;
 }
-*/
+
+// One handler of the driver at index (non-zero), read on its own rather than
+// copying the whole driver out of program memory
+#define DRIVER_HANDLER(index, member) ( \
+    (index) >= GK_PIN_MAX_DRIVERS ? \
+        gk_pin_custom_drivers[(index) - GK_PIN_MAX_DRIVERS].member : \
+        (__typeof__(gk_pin_driver_simple.member)) \
+            pgm_read_ptr(&gk_pin_driver_list[index]->member) \
+)
 
 void gk_pin_set_mode(gkPin pin, gkPinMode mode, gkPinAction level) {
-    if (pin < GK_NUM_PINS && gk_pin_mode_setters[pin])
-        gk_pin_mode_setters[pin](pin, mode, level);
+    if (pin >= GK_NUM_PINS)
+        return;
+    uint8_t entry = gk_pin_drivers[pin];
+    uint8_t index = entry & GK_PIN_DRIVER_INDEX;
+    if (!index)
+        return;
+    gkPinModeSetter* set_mode = DRIVER_HANDLER(index, set_mode);
+    if (!set_mode)
+        return;
+    if (mode == GK_PIN_MODE_OUTPUT && (entry & GK_PIN_INVERTED))
+        level = invert_action(level);
+    set_mode(pin, mode, level);
 }
 
 void gk_pin_write(gkPin pin, gkPinAction action) {
-    if (pin < GK_NUM_PINS && gk_pin_writers[pin])
-        gk_pin_writers[pin](pin, action);
+    if (pin >= GK_NUM_PINS)
+        return;
+    uint8_t entry = gk_pin_drivers[pin];
+    uint8_t index = entry & GK_PIN_DRIVER_INDEX;
+    if (!index)
+        return;
+    gkPinWriter* write = DRIVER_HANDLER(index, write);
+    if (!write)
+        return;
+    if (entry & GK_PIN_INVERTED)
+        action = invert_action(action);
+    write(pin, action);
 }
 
 uint8_t gk_pin_read(gkPin pin) {
-    if (pin < GK_NUM_PINS && gk_pin_readers[pin])
-        return gk_pin_readers[pin](pin);
+    if (pin >= GK_NUM_PINS)
+        return false;
+    uint8_t index = gk_pin_drivers[pin] & GK_PIN_DRIVER_INDEX;
+    if (!index)
+        return false;
+    gkPinReader* read = DRIVER_HANDLER(index, read);
+    if (read)
+        return read(pin);
     else
         return false;
 }
@@ -78,6 +272,54 @@ uint8_t gk_pin_read_simple(gkPin pin) {
     return !!(*portInputRegister(port) & bit);
 }
 
+void gk_port_write(gkPort port, uint8_t mask, gkPinAction action) {
+    if (!port || port > GK_NUM_PORTS)
+        return;
+    volatile uint8_t* out = portOutputRegister(port);
+    uint8_t SREG_orig = SREG;
+    cli();
+    gk_reg_setters[action](out, mask);
+    SREG = SREG_orig;
+}
+
+void gk_port_update(
+    gkPort port,
+    uint8_t set_mask,
+    uint8_t clear_mask,
+    uint8_t toggle_mask
+) {
+    if (!port || port > GK_NUM_PORTS)
+        return;
+    volatile uint8_t* out = portOutputRegister(port);
+    uint8_t SREG_orig = SREG;
+    cli();
+    *out = ((*out & ~clear_mask) | set_mask) ^ toggle_mask;
+    SREG = SREG_orig;
+}
+
+void gk_ports_snapshot(gkPortsSnapshot* snapshot) {
+    // Look up the registers first, so that nothing but the reads happens
+    // between them
+    volatile uint8_t* inputs[GK_NUM_PORTS + 1];
+    uint8_t levels[GK_NUM_PORTS + 1];
+    for (gkPort port = 1; port <= GK_NUM_PORTS; ++port)
+        inputs[port] = portInputRegister(port);
+    uint8_t SREG_orig = SREG;
+    cli();
+    for (gkPort port = 1; port <= GK_NUM_PORTS; ++port)
+        levels[port] = inputs[port] ? *inputs[port] : 0;
+    snapshot->time = gk_time_now();
+    SREG = SREG_orig;
+
+    memset(snapshot->pins, 0, sizeof(snapshot->pins));
+    for (gkPin pin = 0; pin < GK_NUM_PINS; ++pin) {
+        gkPort port = digitalPinToPort(pin);
+        if (port && port <= GK_NUM_PORTS
+                && (levels[port] & digitalPinToBitMask(pin)))
+            snapshot->pins[pin / 8] |= 1 << (pin % 8);
+    }
+}
+
 void gk_reg_on(volatile uint8_t* reg, uint8_t bits) {
     *reg |= bits;
 }
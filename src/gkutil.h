@@ -32,7 +32,55 @@ typedef uint8_t gkPinValue;
 typedef uint8_t gkPort;
 typedef uint8_t gkPinMode;
 typedef uint8_t gkPinAction;
-typedef unsigned long gkTime;
+typedef uint32_t gkTime;
+
+// Time base used for gkTime values, selected at compile time by defining
+// GK_TIME_BASE (e.g., with a compiler flag). GK_TIME_MILLIS, the default,
+// counts milliseconds using millis(). GK_TIME_MICROS counts microseconds using
+// micros(), for 4 us resolution on 16 MHz boards, but wraps around every 71.6
+// minutes instead of every 49.7 days. GK_TIME_TICK counts milliseconds using
+// Timer1 in CTC mode, set up by gk_setup(); unlike millis(), which advances
+// every 1.024 ms and periodically skips a count, every tick is exactly 1 ms
+// long (for any F_CPU that is a multiple of 8 kHz).
+#define GK_TIME_MILLIS 1
+#define GK_TIME_MICROS 2
+#define GK_TIME_TICK 3
+#ifndef GK_TIME_BASE
+#define GK_TIME_BASE GK_TIME_MILLIS
+#endif
+
+// GK_TIME_FINE_PER_UNIT is the number of gk_time_fine() units in each gkTime
+// unit; see gk_time_fine.
+#if GK_TIME_BASE == GK_TIME_MICROS
+#define gk_time_now() micros()
+#define GK_TIME_PER_MS 1000
+#define GK_TIME_PERIOD_NS 1000UL
+#define GK_TIME_FINE_PER_UNIT 1
+#elif GK_TIME_BASE == GK_TIME_MILLIS
+#define gk_time_now() millis()
+#define GK_TIME_PER_MS 1
+#define GK_TIME_PERIOD_NS 1000000UL
+#define GK_TIME_FINE_PER_UNIT 1000
+#elif GK_TIME_BASE == GK_TIME_TICK
+#define gk_time_now() gk_time_ticks()
+#define GK_TIME_PER_MS 1
+// Timer1 runs at F_CPU/8 and counts from 0 to GK_TIME_TICK_TOP each tick
+#define GK_TIME_TICK_TOP ((F_CPU + 4000) / 8000 - 1)
+#define GK_TIME_PERIOD_NS \
+    ((unsigned long)((GK_TIME_TICK_TOP + 1) * 8000000000ULL / F_CPU))
+#define GK_TIME_FINE_PER_UNIT (GK_TIME_TICK_TOP + 1)
+#else
+#error Unknown GK_TIME_BASE
+#endif
+
+// Convert a duration in milliseconds to gkTime units
+#define gk_time_ms(ms) ((gkTime)(ms) * GK_TIME_PER_MS)
+
+// Compare gkTime values in a way that stays correct when the clock wraps
+// around, as long as the two times are less than half the clock range
+// (2^31 units) apart. Never compare gkTime values directly with < or >.
+#define gk_time_before(a, b) ((int32_t)((gkTime)(a) - (gkTime)(b)) < 0)
+#define gk_time_after(a, b) gk_time_before(b, a)
 
 // Type definition for functions manipulating the digital I/O pins. Changing
 // the mode setter, writer, and reader functions for a pin allows its behavior
@@ -90,12 +138,77 @@ typedef gkPinValue gkPinReader(gkPin);
 // Set up the gkutil library
 void gk_setup(void);
 
-void gk_pin_configure(gkPin, gkPinModeSetter*, gkPinWriter*, gkPinReader*);
+// Length of one gkTime unit, in nanoseconds, as actually produced by the
+// hardware
+uint32_t gk_time_period_ns(void);
+
+#if GK_TIME_BASE == GK_TIME_TICK
+// Number of ticks since gk_setup() was called
+gkTime gk_time_ticks(void);
+#endif
+
+// The same clock as gk_time_now(), read at the finest resolution the hardware
+// offers, in units of 1/GK_TIME_FINE_PER_UNIT gkTime units: micros() for the
+// GK_TIME_MILLIS and GK_TIME_MICROS time bases, and Timer1 counts (0.5 us on
+// 16 MHz boards) for GK_TIME_TICK. It wraps around sooner than gk_time_now()
+// (every 71.6 minutes, or 35.8 minutes for ticks on 16 MHz boards). Intended
+// for measuring when things happen, e.g. to synchronize with other clocks.
+uint32_t gk_time_fine(void);
+
+// A pin driver: the handlers for one way of using pins. Drivers are kept in
+// program memory (declared with GK_PIN_DRIVER), and each pin records which one
+// it uses in a single byte of SRAM, rather than a pointer to each handler.
+// Null handlers do nothing, and null readers read 0.
+typedef struct gkPinDriver {
+    gkPinModeSetter* set_mode;
+    gkPinWriter* write;
+    gkPinReader* read;
+} gkPinDriver;
+
+#define GK_PIN_DRIVER(name, setter, writer, reader) \
+    const gkPinDriver name PROGMEM = {setter, writer, reader}
+
+// Number of different drivers that can be in use at once, counting "none".
+// Drivers set with gk_pin_set_driver take one each, and handler combinations
+// passed to gk_pin_configure that match none of them take one of
+// GK_PIN_CUSTOM_DRIVERS slots in SRAM (each the size of a gkPinDriver).
+// Override with compiler flags if desired; together they must be no more
+// than 64.
+#ifndef GK_PIN_MAX_DRIVERS
+#define GK_PIN_MAX_DRIVERS 8
+#endif
+#ifndef GK_PIN_CUSTOM_DRIVERS
+#define GK_PIN_CUSTOM_DRIVERS 2
+#endif
 
-//void gk_pin_configure_simple(gkPin);
-//void gk_pin_configure_disabled(gkPin);
+#if GK_PIN_MAX_DRIVERS < 2 || GK_PIN_MAX_DRIVERS + GK_PIN_CUSTOM_DRIVERS > 64
+#error GK_PIN_MAX_DRIVERS + GK_PIN_CUSTOM_DRIVERS must be from 2 to 64
+#endif
+
+// Each pin's entry in gk_pin_drivers: the index of its driver, and flags. A
+// pin with GK_PIN_INVERTED is active low: gk_pin_write and gk_pin_set_mode
+// (for outputs) swap GK_PIN_WRITE_ON and GK_PIN_WRITE_OFF. The simple driver
+// is always GK_PIN_DRIVER_SIMPLE, so an entry equal to it is a plain pin.
+#define GK_PIN_DRIVER_INDEX 0x3F
+#define GK_PIN_INVERTED 0x80
+#define GK_PIN_DRIVER_NONE 0
+#define GK_PIN_DRIVER_SIMPLE 1
+
+// Set the driver of a pin, keeping its flags. A null driver disables the pin.
+// Returns false, changing nothing, if no more drivers can be in use.
+bool gk_pin_set_driver(gkPin, const gkPinDriver*);
+// Configure a pin with any combination of handlers, using a matching driver
+// already in use, or else a custom driver slot. Does nothing if there are no
+// slots left.
+void gk_pin_configure(gkPin, gkPinModeSetter*, gkPinWriter*, gkPinReader*);
+// Copy the handlers of a pin's driver into driver. Returns false if the pin
+// has none.
+bool gk_pin_get_driver(gkPin, gkPinDriver* driver);
+// Make a pin active low, or not
+void gk_pin_set_inverted(gkPin, bool inverted);
 
-#define gk_pin_disable(pin) gk_pin_configure(pin, 0, 0, 0)
+#define gk_pin_disable(pin) gk_pin_set_driver(pin, 0)
+#define gk_pin_inverted(pin) (!!(gk_pin_drivers[pin] & GK_PIN_INVERTED))
 
 // Basic digital I/O functions. Will call the individual I/O handler function
 // for the specific pin requested.
@@ -108,55 +221,65 @@ void gk_pin_set_mode_simple(gkPin, gkPinMode, gkPinAction);
 void gk_pin_write_simple(gkPin, gkPinAction);
 gkPinValue gk_pin_read_simple(gkPin);
 
+extern const gkPinDriver gk_pin_driver_simple PROGMEM;
+
 #define gk_pin_configure_simple(pin) \
-    gk_pin_configure( \
-        pin, \
-        gk_pin_set_mode_simple, \
-        gk_pin_write_simple, \
-        gk_pin_read_simple \
-    )
-
-// Tables of pin digital I/O handlers
+    gk_pin_set_driver(pin, &gk_pin_driver_simple)
+
+// Table of each pin's driver index and flags
 #ifdef GKUTIL_GLOBAL
-gkPinModeSetter* gk_pin_mode_setters[GK_NUM_PINS] = {0};
-gkPinWriter* gk_pin_writers[GK_NUM_PINS] = {0};
-gkPinReader* gk_pin_readers[GK_NUM_PINS] = {0};
+uint8_t gk_pin_drivers[GK_NUM_PINS] = {0};
 #else
-extern gkPinModeSetter* gk_pin_mode_setters[GK_NUM_PINS];
-extern gkPinWriter* gk_pin_writers[GK_NUM_PINS];
-extern gkPinReader* gk_pin_readers[GK_NUM_PINS];
+extern uint8_t gk_pin_drivers[GK_NUM_PINS];
 #endif
 
-/*
-inline
-gkPinModeSetter* gk_pin_set_mode_setter(gkPin pin, gkPinModeSetter* setter) {
-    gkPinModeSetter* orig_setter = gk_pin_mode_setters[pin];
-    gk_pin_mode_setters[pin] = setter;
-    return orig_setter;
-}
+// Which driver indices write with gk_pin_write_simple, one bit per index, so
+// that writes to their pins can go straight to the port (as the schedule does)
+#define GK_PIN_SIMPLE_WRITERS_SIZE \
+    ((GK_PIN_MAX_DRIVERS + GK_PIN_CUSTOM_DRIVERS + 7) / 8)
+#ifdef GKUTIL_GLOBAL
+uint8_t gk_pin_simple_writers[GK_PIN_SIMPLE_WRITERS_SIZE] = {
+    1 << GK_PIN_DRIVER_SIMPLE,
+};
+#else
+extern uint8_t gk_pin_simple_writers[GK_PIN_SIMPLE_WRITERS_SIZE];
+#endif
 
-inline
-gkPinWriter* gk_pin_set_writer(gkPin pin, gkPinWriter* writer) {
-    gkPinWriter* orig_writer = gk_pin_writers[pin];
-    gk_pin_writers[pin] = writer;
-    return orig_writer;
-}
+// Whether a pin's driver writes with gk_pin_write_simple (whether or not the
+// pin is inverted)
+#define gk_pin_writes_simple(pin) ( \
+    gk_pin_simple_writers[(gk_pin_drivers[pin] & GK_PIN_DRIVER_INDEX) / 8] \
+        & (1 << (gk_pin_drivers[pin] & 7)) \
+)
 
-inline
-gkPinReader* gk_pin_set_reader(gkPin pin, gkPinReader* reader) {
-    gkPinReader* orig_reader = gk_pin_readers[pin];
-    gk_pin_readers[pin] = reader;
-    return orig_reader;
-}
+// Port-level digital output. Ports are numbered as by digitalPinToPort, and
+// each bit of a mask corresponds to a pin on the port as given by
+// digitalPinToBitMask. These act directly on the port's output register,
+// bypassing the per-pin writers, and change all of the pins in the mask in a
+// single register write.
+// Take the same action on every pin in mask
+void gk_port_write(gkPort port, uint8_t mask, gkPinAction action);
+// Turn on the pins in set_mask, turn off the pins in clear_mask, then toggle
+// the pins in toggle_mask
+void gk_port_update(
+    gkPort port,
+    uint8_t set_mask,
+    uint8_t clear_mask,
+    uint8_t toggle_mask
+);
 
-#ifdef GKUTIL_GLOBAL
-// Non-inlined declarations to force the compiler to produce symbols, per
-// the recommendation of Modern C
-gkPinModeSetter* gk_pin_set_mode_setter(gkPin, gkPinModeSetter*);
-gkPinWriter* gk_pin_set_writer(gkPin, gkPinWriter*);
-gkPinReader* gk_pin_set_reader(gkPin, gkPinReader*);
-#endif
-*/
+// Port-level digital input. gk_ports_snapshot reads the input register of
+// every port (1 to GK_NUM_PORTS) back-to-back with interrupts disabled, so
+// that all of the levels come from within a few cycles of each other, and
+// records the time of the reading. Like gk_port_write, it bypasses the per-pin
+// readers: every pin is read as it is on the hardware, whatever its mode.
+// Bit (pin % 8) of pins[pin / 8] is the level of pin.
+#define GK_PORTS_SNAPSHOT_SIZE ((GK_NUM_PINS + 7) / 8)
+typedef struct gkPortsSnapshot {
+    gkTime time;
+    uint8_t pins[GK_PORTS_SNAPSHOT_SIZE];
+} gkPortsSnapshot;
+void gk_ports_snapshot(gkPortsSnapshot* snapshot);
 
 // Utility functions to flexibly change register values
 typedef void gkRegSetter(volatile uint8_t*, uint8_t);
@@ -0,0 +1,152 @@
+#include "gkutil.h"
+#include "debounce.h"
+#include "listener.h"
+
+/*
+Each debounced pin counts down the samples left before a new level can be
+accepted. While a pin's input matches its debounced level, its count is held
+at its filter length - 1; each sample that differs counts it down, and a sample
+that differs when it is already 0 flips the debounced level and starts it over.
+
+The counts of a port's 8 pins are stored as bit planes: bit n of count[k] is
+bit k of pin n's count (and the same for reload, its starting count). Counting
+down every pin that differs then takes one pass of a borrow through the
+planes, and reloading every other pin one masked merge per plane.
+*/
+
+typedef struct PortDebounce {
+    uint8_t mask;                       // pins being debounced
+    uint8_t level;                      // their debounced levels
+    uint8_t count[GK_DEBOUNCE_BITS];
+    uint8_t reload[GK_DEBOUNCE_BITS];
+} PortDebounce;
+
+#define DEBOUNCE_PERIOD_FINE ((uint32_t)( \
+    (uint64_t)GK_DEBOUNCE_PERIOD_US * 1000 * GK_TIME_FINE_PER_UNIT \
+    / GK_TIME_PERIOD_NS \
+))
+
+PortDebounce debounce_ports[GK_NUM_PORTS + 1] = {0};
+// Bitmask of the ports with debounced pins
+uint16_t debounce_active_ports = 0;
+uint32_t debounce_last_sample = 0;
+
+void gk_debounce_setup(void) {
+    for (gkPort port = 1; port <= GK_NUM_PORTS; ++port) {
+        if (debounce_ports[port].mask)
+            gk_listeners_set_filtered(port, 0);
+    }
+    memset(debounce_ports, 0, sizeof(debounce_ports));
+    debounce_active_ports = 0;
+    debounce_last_sample = gk_time_fine();
+}
+
+bool gk_debounce_set(gkPin pin, uint8_t length) {
+    if (pin >= GK_NUM_PINS || length > GK_DEBOUNCE_MAX_LENGTH)
+        return false;
+    gkPort port = digitalPinToPort(pin);
+    uint8_t bit_mask = digitalPinToBitMask(pin);
+    if (!port || port > GK_NUM_PORTS)
+        return false;
+
+    PortDebounce *debounce = &debounce_ports[port];
+    if (length) {
+        for (uint8_t plane = 0; plane < GK_DEBOUNCE_BITS; ++plane) {
+            if ((length - 1) & (1 << plane))
+                debounce->reload[plane] |= bit_mask;
+            else
+                debounce->reload[plane] &= ~bit_mask;
+            debounce->count[plane] = (debounce->count[plane] & ~bit_mask)
+                | (debounce->reload[plane] & bit_mask);
+        }
+        if (!(debounce->mask & bit_mask)) {
+            // Start from the level the pin is at now
+            if (*portInputRegister(port) & bit_mask)
+                debounce->level |= bit_mask;
+            else
+                debounce->level &= ~bit_mask;
+            debounce->mask |= bit_mask;
+        }
+        debounce_active_ports |= 1 << port;
+    } else {
+        debounce->mask &= ~bit_mask;
+        if (!debounce->mask)
+            debounce_active_ports &= ~(1 << port);
+    }
+    gk_listeners_set_filtered(port, debounce->mask);
+    return true;
+}
+
+uint8_t gk_debounce_length(gkPin pin) {
+    if (pin >= GK_NUM_PINS)
+        return 0;
+    gkPort port = digitalPinToPort(pin);
+    uint8_t bit_mask = digitalPinToBitMask(pin);
+    if (!port || port > GK_NUM_PORTS)
+        return 0;
+
+    PortDebounce *debounce = &debounce_ports[port];
+    if (!(debounce->mask & bit_mask))
+        return 0;
+    uint8_t length = 1;
+    for (uint8_t plane = 0; plane < GK_DEBOUNCE_BITS; ++plane) {
+        if (debounce->reload[plane] & bit_mask)
+            length += 1 << plane;
+    }
+    return length;
+}
+
+void gk_debounce_update(void) {
+    uint32_t fine = gk_time_fine();
+    if (!debounce_active_ports || fine - debounce_last_sample
+            < DEBOUNCE_PERIOD_FINE)
+        return;
+    debounce_last_sample = fine;
+    gkTime now = gk_time_now();
+
+    uint16_t ports = debounce_active_ports;
+    for (gkPort port = 1; ports; ++port) {
+        if (!(ports & (1 << port)))
+            continue;
+        ports &= ~(1 << port);
+
+        PortDebounce *debounce = &debounce_ports[port];
+        uint8_t differ =
+            debounce->mask & (*portInputRegister(port) ^ debounce->level);
+        uint8_t counting = 0;
+        for (uint8_t plane = 0; plane < GK_DEBOUNCE_BITS; ++plane)
+            counting |= debounce->count[plane];
+        // Pins that differ with nothing left to count take the new level
+        uint8_t change = differ & ~counting;
+        debounce->level ^= change;
+
+        // Count down the pins that differ, and start the rest over
+        uint8_t restart = ~differ | change;
+        uint8_t borrow = 0xFF;
+        for (uint8_t plane = 0; plane < GK_DEBOUNCE_BITS; ++plane) {
+            uint8_t bits = debounce->count[plane] ^ borrow;
+            borrow &= bits;
+            debounce->count[plane] =
+                (bits & ~restart) | (debounce->reload[plane] & restart);
+        }
+
+        if (change)
+            gk_listeners_queue(port, debounce->level, change, now);
+    }
+}
+
+gkPinValue gk_pin_read_debounced(gkPin pin) {
+    gkPort port = digitalPinToPort(pin);
+    uint8_t bit_mask = digitalPinToBitMask(pin);
+    if (port && port <= GK_NUM_PORTS
+            && (debounce_ports[port].mask & bit_mask))
+        return !!(debounce_ports[port].level & bit_mask);
+    return gk_pin_read_simple(pin);
+}
+
+GK_PIN_DRIVER(
+    gk_pin_driver_debounced,
+    gk_pin_set_mode_simple,
+    gk_pin_write_simple,
+    gk_pin_read_debounced
+);
@@ -0,0 +1,63 @@
+/* debounce.h
+Debouncing of digital inputs, such as levers and lick contacts, whose contacts
+bounce. Debounced inputs are sampled every GK_DEBOUNCE_PERIOD_US, and a new
+level is only accepted once it has been seen in a row for the pin's filter
+length, from 1 to GK_DEBOUNCE_MAX_LENGTH samples.
+
+All 8 pins of a port are filtered at once: each pin's count of samples is kept
+as a vertical counter, one bit of it in each of GK_DEBOUNCE_BITS bytes per
+port, so a sample costs the same few instructions per port however many of its
+pins are debounced, and whatever their filter lengths.
+
+Debounced levels feed both reads and listeners. gk_pin_read_debounced is a
+reader, in the gk_pin_driver_debounced driver (see gk_pin_configure_debounced),
+that returns the debounced level.
+Listeners (see gkutil/listener.h) on a debounced pin only hear of accepted
+changes, timestamped with the sample that accepted them; the change itself
+began (length - 1) sample periods earlier. Samples are taken in the main loop,
+by gk_debounce_update, so a busy loop lengthens the filter, but never shortens
+it.
+*/
+
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include "gkutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Time between samples, in microseconds. Override with a compiler flag if
+// desired.
+#ifndef GK_DEBOUNCE_PERIOD_US
+#define GK_DEBOUNCE_PERIOD_US 1000
+#endif
+
+// Bits in each pin's count of samples, and so the longest filter length
+#define GK_DEBOUNCE_BITS 4
+#define GK_DEBOUNCE_MAX_LENGTH (1 << GK_DEBOUNCE_BITS)
+
+void gk_debounce_setup(void);
+// Debounce pin, accepting a new level once it has been seen in length samples
+// in a row (at most GK_DEBOUNCE_MAX_LENGTH). A length of 0 stops debouncing
+// the pin. Returns false if the pin doesn't exist or the length is too long.
+bool gk_debounce_set(gkPin pin, uint8_t length);
+// Return pin's filter length, or 0 if it isn't being debounced
+uint8_t gk_debounce_length(gkPin pin);
+// Sample the debounced pins, if a sample is due. Call this from the main loop.
+void gk_debounce_update(void);
+
+// Reader returning the debounced level of a pin, or its level on the hardware
+// if it isn't being debounced
+gkPinValue gk_pin_read_debounced(gkPin pin);
+
+extern const gkPinDriver gk_pin_driver_debounced PROGMEM;
+
+#define gk_pin_configure_debounced(pin) \
+    gk_pin_set_driver(pin, &gk_pin_driver_debounced)
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,250 @@
+/* fastpin.h
+Compile-time specialized digital I/O for C++ sketches. When a pin number is
+known at compile time, gk::Pin<N> resolves its port and bit while compiling,
+so that writes and reads become a single instruction (e.g., sbi/cbi/sbic),
+instead of going through the pin drivers in gkutil.h, the PROGMEM pin
+lookups, and two indirect function calls.
+
+This only works on boards whose pin layout is described below (currently the
+ATmega328P/168 boards, such as the Uno and Nano, and the ATmega2560/1280
+boards, such as the Mega). On other boards the same code still compiles, but
+falls back to the runtime "simple" pin functions.
+
+gk::Pin interoperates with the pin drivers: configure() sets the same driver
+that gk_pin_configure_simple would (or whatever the Driver chooses),
+so the pin can still be scheduled, or written with gk_pin_write, as usual.
+
+Usage:
+    typedef gk::Pin<13> Led;
+    Led::configure();
+    Led::set_mode(GK_PIN_MODE_OUTPUT, GK_PIN_WRITE_OFF);
+    Led::on();
+    Led::write(GK_PIN_WRITE_TOGGLE);
+*/
+#ifndef FASTPIN_H
+#define FASTPIN_H
+
+#include "gkutil.h"
+
+#ifdef __cplusplus
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) \
+    || defined(__AVR_ATmega168__) || defined(__AVR_ATmega168P__)
+#define GK_FASTPIN_PORTS "DDDDDDDDBBBBBBCCCCCC"
+#define GK_FASTPIN_BITS  "01234567012345012345"
+#elif defined(__AVR_ATmega2560__) || defined(__AVR_ATmega1280__)
+#define GK_FASTPIN_PORTS \
+    "EEEEGEHHHHBBBBJJHHDDDDAAAAAAAACCCCCCCCDGGGLLLLLLLLBBBBFFFFFFFFKKKKKKKK"
+#define GK_FASTPIN_BITS \
+    "0145533456456710103210012345677654321072107654321032100123456701234567"
+#endif
+
+namespace gk {
+
+namespace detail {
+
+// Registers for each port, by letter. Ports A-G lie in the low I/O space on
+// all supported chips, so single-bit writes to them compile to one atomic
+// sbi/cbi; writes to the others need interrupts disabled around them.
+template <char P> struct Port;
+
+#define GK_FASTPIN_PORT(letter, atomic_bits)                        \
+    template <> struct Port<#letter[0]> {                           \
+        static const bool atomic = atomic_bits;                     \
+        static volatile uint8_t& out() { return PORT##letter; }     \
+        static volatile uint8_t& in() { return PIN##letter; }       \
+        static volatile uint8_t& mode() { return DDR##letter; }     \
+    };
+
+#ifdef PORTA
+GK_FASTPIN_PORT(A, true)
+#endif
+#ifdef PORTB
+GK_FASTPIN_PORT(B, true)
+#endif
+#ifdef PORTC
+GK_FASTPIN_PORT(C, true)
+#endif
+#ifdef PORTD
+GK_FASTPIN_PORT(D, true)
+#endif
+#ifdef PORTE
+GK_FASTPIN_PORT(E, true)
+#endif
+#ifdef PORTF
+GK_FASTPIN_PORT(F, true)
+#endif
+#ifdef PORTG
+GK_FASTPIN_PORT(G, true)
+#endif
+#ifdef PORTH
+GK_FASTPIN_PORT(H, false)
+#endif
+#ifdef PORTJ
+GK_FASTPIN_PORT(J, false)
+#endif
+#ifdef PORTK
+GK_FASTPIN_PORT(K, false)
+#endif
+#ifdef PORTL
+GK_FASTPIN_PORT(L, false)
+#endif
+#undef GK_FASTPIN_PORT
+
+// Set or clear bits of a register, atomically
+template <bool atomic>
+inline void reg_set(volatile uint8_t& reg, uint8_t mask, bool on) {
+    if (atomic) {
+        if (on)
+            reg |= mask;
+        else
+            reg &= ~mask;
+    } else {
+        uint8_t SREG_orig = SREG;
+        cli();
+        if (on)
+            reg |= mask;
+        else
+            reg &= ~mask;
+        SREG = SREG_orig;
+    }
+}
+
+#ifdef GK_FASTPIN_PORTS
+template <gkPin N>
+struct PinInfo {
+    static_assert(N < sizeof(GK_FASTPIN_PORTS) - 1, "No such pin");
+    typedef Port<GK_FASTPIN_PORTS[N]> port;
+    static const uint8_t mask = 1 << (GK_FASTPIN_BITS[N] - '0');
+};
+#endif
+
+} // namespace detail
+
+// Drivers determine how a gk::Pin is configured, written, and read. Each
+// provides static member templates configure<N>(), set_mode<N>(mode, action),
+// write<N>(action), and read<N>(), and custom drivers may be written the same
+// way.
+
+// Act directly on the pin's registers, resolved at compile time. Equivalent to
+// the runtime "simple" pin functions in gkutil.h.
+struct Direct {
+    template <gkPin N>
+    static void configure() {
+        gk_pin_configure_simple(N);
+    }
+
+#ifdef GK_FASTPIN_PORTS
+    template <gkPin N>
+    static inline void set_mode(gkPinMode mode, gkPinAction action) {
+        typedef detail::PinInfo<N> P;
+        uint8_t SREG_orig = SREG;
+        cli();
+        if (mode == GK_PIN_MODE_OUTPUT)
+            P::port::mode() |= P::mask;
+        else if (mode == GK_PIN_MODE_INPUT)
+            P::port::mode() &= ~P::mask;
+        write<N>(action);
+        SREG = SREG_orig;
+    }
+
+    template <gkPin N>
+    static inline void write(gkPinAction action) {
+        typedef detail::PinInfo<N> P;
+        switch (action) {
+        case GK_PIN_WRITE_ON:
+            detail::reg_set<P::port::atomic>(P::port::out(), P::mask, true);
+            break;
+        case GK_PIN_WRITE_OFF:
+            detail::reg_set<P::port::atomic>(P::port::out(), P::mask, false);
+            break;
+        case GK_PIN_WRITE_TOGGLE:
+            // Writing a 1 to a PIN register bit toggles the output
+            P::port::in() = P::mask;
+            break;
+        }
+    }
+
+    template <gkPin N>
+    static inline gkPinValue read() {
+        typedef detail::PinInfo<N> P;
+        return (P::port::in() & P::mask) ? 1 : 0;
+    }
+#else
+    template <gkPin N>
+    static inline void set_mode(gkPinMode mode, gkPinAction action) {
+        gk_pin_set_mode_simple(N, mode, action);
+    }
+
+    template <gkPin N>
+    static inline void write(gkPinAction action) {
+        gk_pin_write_simple(N, action);
+    }
+
+    template <gkPin N>
+    static inline gkPinValue read() {
+        return gk_pin_read_simple(N);
+    }
+#endif
+};
+
+// Go through the pin drivers in gkutil.h, for pins whose drivers are set
+// elsewhere (e.g., modulated pins) or may change while running.
+struct Dispatch {
+    template <gkPin N>
+    static void configure() {}
+
+    template <gkPin N>
+    static inline void set_mode(gkPinMode mode, gkPinAction action) {
+        gk_pin_set_mode(N, mode, action);
+    }
+
+    template <gkPin N>
+    static inline void write(gkPinAction action) {
+        gk_pin_write(N, action);
+    }
+
+    template <gkPin N>
+    static inline gkPinValue read() {
+        return gk_pin_read(N);
+    }
+};
+
+template <gkPin N, class Driver = Direct>
+struct Pin {
+    static const gkPin number = N;
+
+    // Set this pin's driver in gkutil.h
+    static void configure() {
+        Driver::template configure<N>();
+    }
+
+    static inline void set_mode(gkPinMode mode, gkPinAction action) {
+        Driver::template set_mode<N>(mode, action);
+    }
+
+    static inline void write(gkPinAction action) {
+        Driver::template write<N>(action);
+    }
+
+    static inline void on() {
+        write(GK_PIN_WRITE_ON);
+    }
+
+    static inline void off() {
+        write(GK_PIN_WRITE_OFF);
+    }
+
+    static inline void toggle() {
+        write(GK_PIN_WRITE_TOGGLE);
+    }
+
+    static inline gkPinValue read() {
+        return Driver::template read<N>();
+    }
+};
+
+} // namespace gk
+
+#endif //ifdef __cplusplus
+#endif //ifndef FASTPIN_H
@@ -0,0 +1,285 @@
+#include "gkutil.h"
+#define LISTENER_GLOBAL
+#include "listener.h"
+#undef LISTENER_GLOBAL
+
+/*
+Input changes are captured in the pin change interrupts. Each interrupt reads
+the input register of every port with listeners in its PCINT group, compares it
+against the last value seen, and if any listened-to inputs changed, pushes the
+new value, the changed bits, and a timestamp onto the event ring.
+
+The ring has a single producer (the interrupts, which can't interrupt each
+other) and a single consumer (gk_listeners_execute, in the main loop), so it
+needs no locking: the producer only ever writes `event_tail` and the consumer
+only ever writes `event_head`, each a single byte and so written atomically.
+One slot is always left empty to tell a full ring from an empty one. When the
+ring is full, new changes are dropped and counted, rather than overwriting
+changes that haven't been handled yet.
+
+Pins filtered by the debounce stage (gkutil/debounce.h) are left out of the
+capture, and their pin change interrupts disabled; the debounce stage queues
+their accepted changes instead, with interrupts disabled so that it can't
+collide with the interrupts pushing onto the ring.
+*/
+
+typedef struct PortListeners {
+    uint8_t last_input;
+    uint8_t listeners_mask;
+    uint8_t filtered_mask;
+    gkListener *listeners[8];
+    gkPin pins[8];
+} PortListeners;
+
+typedef struct QueuedEvent {
+    gkTime timestamp;
+    gkPort port;
+    uint8_t input;
+    uint8_t change;
+} QueuedEvent;
+
+// PCINT groups, each with its own interrupt vector
+#if defined(PCINT3_vect)
+#define NUM_PCINT_GROUPS 4
+#elif defined(PCINT2_vect)
+#define NUM_PCINT_GROUPS 3
+#elif defined(PCINT1_vect)
+#define NUM_PCINT_GROUPS 2
+#else
+#define NUM_PCINT_GROUPS 1
+#endif
+
+PortListeners port_listeners[GK_NUM_PORTS + 1] = {0};
+// Bitmask of the ports with listeners in each PCINT group
+volatile uint16_t group_ports[NUM_PCINT_GROUPS] = {0};
+
+QueuedEvent event_buffer[LISTENER_EVENT_BUFFER_SIZE];
+volatile uint8_t event_head = 0;
+volatile uint8_t event_tail = 0;
+volatile uint16_t event_overflows = 0;
+
+#define EVENT_BUFFER_NEXT(i) ( \
+    ((i) + 1 == LISTENER_EVENT_BUFFER_SIZE) ? 0 : (i) + 1 \
+)
+
+// Push an input change onto the ring, or count it as lost if the ring is full.
+// Called with interrupts disabled.
+static void listeners_push(
+    gkPort port,
+    uint8_t input,
+    uint8_t change,
+    gkTime time
+) {
+    uint8_t tail = event_tail;
+    uint8_t next_tail = EVENT_BUFFER_NEXT(tail);
+    if (next_tail == event_head) {
+        if (event_overflows < 0xFFFF)
+            ++event_overflows;
+        return;
+    }
+    QueuedEvent *event = &event_buffer[tail];
+    event->timestamp = time;
+    event->port = port;
+    event->input = input;
+    event->change = change;
+    event_tail = next_tail;
+}
+
+// Called from the pin change interrupt for a PCINT group
+static void listeners_capture(uint8_t group) {
+    gkTime now = gk_time_now();
+    uint16_t ports = group_ports[group];
+    for (gkPort port = 1; ports; ++port) {
+        if (!(ports & (1 << port)))
+            continue;
+        ports &= ~(1 << port);
+
+        PortListeners *listeners = &port_listeners[port];
+        uint8_t new_input = *portInputRegister(port);
+        uint8_t input_change =
+            listeners->listeners_mask & ~listeners->filtered_mask
+            & (listeners->last_input ^ new_input);
+        if (!input_change)
+            continue;
+        listeners->last_input = new_input;
+        listeners_push(port, new_input, input_change, now);
+    }
+}
+
+ISR(PCINT0_vect) {
+    listeners_capture(0);
+}
+#if NUM_PCINT_GROUPS > 1
+ISR(PCINT1_vect) {
+    listeners_capture(1);
+}
+#endif
+#if NUM_PCINT_GROUPS > 2
+ISR(PCINT2_vect) {
+    listeners_capture(2);
+}
+#endif
+#if NUM_PCINT_GROUPS > 3
+ISR(PCINT3_vect) {
+    listeners_capture(3);
+}
+#endif
+
+void gk_listeners_setup(void) {
+    uint8_t SREG_orig = SREG;
+    cli();
+    event_head = event_tail;
+    event_overflows = 0;
+    SREG = SREG_orig;
+}
+
+bool gk_listener_set(gkPin pin, gkListener listener) {
+    if (pin >= GK_NUM_PINS || !digitalPinToPCICR(pin))
+        return false;
+    uint8_t port = digitalPinToPort(pin);
+    uint8_t bit_mask = digitalPinToBitMask(pin);
+    uint8_t group = digitalPinToPCICRbit(pin);
+    if (!port || port > GK_NUM_PORTS || group >= NUM_PCINT_GROUPS)
+        return false;
+
+    uint8_t SREG_orig = SREG;
+    cli();
+    PortListeners *listeners = &port_listeners[port];
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+        if (bit_mask & (1<<bit)) {
+            listeners->listeners[bit] = listener;
+            listeners->pins[bit] = pin;
+            break;
+        }
+    }
+    listeners->listeners_mask |= bit_mask;
+    if ((*portInputRegister(port)) & bit_mask)
+        listeners->last_input |= bit_mask;
+    else
+        listeners->last_input &= ~bit_mask;
+    group_ports[group] |= 1 << port;
+    if (!(listeners->filtered_mask & bit_mask))
+        *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+    *digitalPinToPCICR(pin) |= _BV(group);
+    SREG = SREG_orig;
+    return true;
+}
+
+void gk_listener_clear(gkPin pin) {
+    if (pin >= GK_NUM_PINS || !digitalPinToPCICR(pin))
+        return;
+    uint8_t port = digitalPinToPort(pin);
+    uint8_t bit_mask = digitalPinToBitMask(pin);
+    if (!port || port > GK_NUM_PORTS)
+        return;
+
+    uint8_t SREG_orig = SREG;
+    cli();
+    PortListeners *listeners = &port_listeners[port];
+    listeners->listeners_mask &= ~bit_mask;
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+        if (bit_mask & (1<<bit)) {
+            listeners->listeners[bit] = (void*)0;
+            break;
+        }
+    }
+    // The pin change interrupt is left enabled for the rest of the group, but
+    // this pin no longer needs to trigger it
+    *digitalPinToPCMSK(pin) &= ~_BV(digitalPinToPCMSKbit(pin));
+    SREG = SREG_orig;
+}
+
+void gk_listeners_set_filtered(gkPort port, uint8_t mask) {
+    if (!port || port > GK_NUM_PORTS)
+        return;
+
+    uint8_t SREG_orig = SREG;
+    cli();
+    PortListeners *listeners = &port_listeners[port];
+    uint8_t input = *portInputRegister(port);
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+        uint8_t bit_mask = 1 << bit;
+        if (!(listeners->listeners_mask & bit_mask)
+                || !((listeners->filtered_mask ^ mask) & bit_mask))
+            continue;
+        gkPin pin = listeners->pins[bit];
+        if (mask & bit_mask) {
+            *digitalPinToPCMSK(pin) &= ~_BV(digitalPinToPCMSKbit(pin));
+        } else {
+            // Capture raw changes again from the level the pin is at now
+            listeners->last_input =
+                (listeners->last_input & ~bit_mask) | (input & bit_mask);
+            *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+        }
+    }
+    listeners->filtered_mask = mask;
+    SREG = SREG_orig;
+}
+
+void gk_listeners_queue(
+    gkPort port,
+    uint8_t input,
+    uint8_t change,
+    gkTime time
+) {
+    if (!port || port > GK_NUM_PORTS)
+        return;
+    change &= port_listeners[port].listeners_mask;
+    if (!change)
+        return;
+    uint8_t SREG_orig = SREG;
+    cli();
+    listeners_push(port, input, change, time);
+    SREG = SREG_orig;
+}
+
+uint8_t gk_listeners_queued(void) {
+    uint8_t head = event_head;
+    uint8_t tail = event_tail;
+    if (tail >= head)
+        return tail - head;
+    else
+        return LISTENER_EVENT_BUFFER_SIZE - head + tail;
+}
+
+uint16_t gk_listeners_overflows(void) {
+    uint8_t SREG_orig = SREG;
+    cli();
+    uint16_t overflows = event_overflows;
+    SREG = SREG_orig;
+    return overflows;
+}
+
+void gk_listeners_clear_overflows(void) {
+    uint8_t SREG_orig = SREG;
+    cli();
+    event_overflows = 0;
+    SREG = SREG_orig;
+}
+
+void gk_listeners_execute(void) {
+    uint8_t head = event_head;
+    while (head != event_tail) {
+        // For each event currently in the queue...
+        QueuedEvent* event = &(event_buffer[head]);
+        PortListeners *listeners = &port_listeners[event->port];
+        for (uint8_t bit = 0; bit < 8; ++bit) {
+            // Check whether each input of the associated port changed, and
+            // whether it still has an active listener
+            uint8_t bitmask = 1<<bit;
+            gkPin pin = listeners->pins[bit];
+            gkListener *listener = listeners->listeners[bit];
+            if ( (event->change & bitmask) && listener ) {
+                gkPinValue value = (event->input & bitmask) ?
+                    GK_PIN_LEVEL_HIGH : GK_PIN_LEVEL_LOW;
+                // Call the listener callback. If it returns true, unset the
+                // listener.
+                if (listener(pin, value, event->timestamp))
+                    gk_listener_clear(pin);
+            }
+        }
+        // Only now release the slot back to the interrupts
+        head = EVENT_BUFFER_NEXT(head);
+        event_head = head;
+    }
+}
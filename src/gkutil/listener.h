@@ -1,5 +1,17 @@
-// This is an experimental interface for implementing digital input "listener"
-// callbacks, but I'm not sure this is going to remain.
+/* listener.h
+Digital input "listeners": callbacks run when a watched input changes. Edges
+are captured by pin change interrupts, timestamped as they happen, and queued
+in a ring buffer; the callbacks are then run from the main loop by calling
+gk_listeners_execute().
+
+Only pins with a pin change interrupt (PCINT) can be listened to. On the Uno
+and other ATmega328P boards that is every pin; on the Mega it is pins 0, 10-15,
+50-53, and A8-A15. The timestamps come from gk_time_now(), so use the
+GK_TIME_MICROS time base (see gkutil.h) for microsecond resolution.
+
+Listeners on pins being debounced (see gkutil/debounce.h) only hear of the
+changes the debounce stage accepts, rather than every bounce.
+*/
 
 #ifndef LISTENER_H
 #define LISTENER_H
@@ -17,21 +29,49 @@
 extern "C" {
 #endif
 
-#define LISTENER_EVENT_BUFFER_SIZE 20
+// Number of input changes that can be queued before any are lost. Each takes
+// 7 bytes. Override with a compiler flag if desired; must be 2-255.
+#ifndef LISTENER_EVENT_BUFFER_SIZE
+#define LISTENER_EVENT_BUFFER_SIZE 32
+#endif
+
+#if LISTENER_EVENT_BUFFER_SIZE < 2 || LISTENER_EVENT_BUFFER_SIZE > 255
+#error LISTENER_EVENT_BUFFER_SIZE must be from 2 to 255
+#endif
 
+// A listener is called with the pin that changed, its new level
+// (GK_PIN_LEVEL_HIGH or GK_PIN_LEVEL_LOW), and the time of the change. If it
+// returns true, it is removed.
 typedef uint8_t gkListener(gkPin, gkPinValue, gkTime);
 
 void gk_listeners_setup(void);
-void gk_listener_set(gkPin, gkListener);
+// Start listening to a pin. Returns false if the pin has no pin change
+// interrupt, and so can't be listened to.
+bool gk_listener_set(gkPin, gkListener);
 void gk_listener_clear(gkPin);
-// Update but do not execute listeners, return the number currently queued
-uint8_t gk_listeners_update(void);
-// Return the number currently queued without updating
+// Return the number of input changes currently queued
 uint8_t gk_listeners_queued(void);
-// Execute currently all queued listeners
+// Execute the listeners for all currently queued input changes
 void gk_listeners_execute(void);
+// Get the number of input changes lost because the queue was full, since
+// startup or the last call to gk_listeners_clear_overflows
+uint16_t gk_listeners_overflows(void);
+void gk_listeners_clear_overflows(void);
+
+// For filters such as the debounce stage (gkutil/debounce.h): stop capturing
+// the raw changes of the pins of port in mask (and start again for the rest),
+// and queue input changes for the listeners on port as though they had been
+// captured, with input holding the new levels and change the pins that changed.
+void gk_listeners_set_filtered(gkPort port, uint8_t mask);
+void gk_listeners_queue(
+    gkPort port,
+    uint8_t input,
+    uint8_t change,
+    gkTime time
+);
 
 #ifdef __cplusplus
 }
 #endif
+#undef EXTERN
 #endif
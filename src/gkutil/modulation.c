@@ -4,38 +4,235 @@
 #define MODULATION_GLOBAL
 #include "modulation.h"
 #undef MODULATION_GLOBAL
+#include "schedule.h"
 
-int modulator_threshold_a = 0;
-int modulator_threshold_b = 0;
+// The timers whose outputs can be modulated. Each runs in fast PWM mode, with
+// the carrier period set by ICRn on the 16-bit timers (mode 14), or by OCR2A
+// on Timer2 (mode 7), which leaves only its B output free. The WGMn bits sit
+// in the same places on all of the 16-bit timers.
+typedef struct ModulationTimer {
+    volatile uint8_t *control_a;
+    volatile uint8_t *control_b;
+    volatile void *counter;
+    volatile void *top;
+    volatile void *compare[3];
+    uint8_t outputs[3]; // digitalPinToTimer values of the A, B and C outputs
+    bool wide;
+    uint8_t wgm_a;
+    uint8_t wgm_b;
+} ModulationTimer;
 
-#if MODULATION_TIMER == TIMER2B
-#define CONFIGURE_TIMER_REGISTERS {             \
-    TCCR2A = _BV(WGM20);                        \
-    TCCR2B = _BV(WGM22) | _BV(CS20);            \
-    OCR2A = (uint8_t) modulator_threshold_a;    \
-    OCR2B = (uint8_t) modulator_threshold_b;    \
-}
-#define SET_TIMER_OUTPUT(level) {                   \
-    gk_reg_setters[level](&TCCR2A, _BV(COM2B1));    \
-}
+#define WGM_16BIT_A _BV(WGM11)
+#define WGM_16BIT_B (_BV(WGM13) | _BV(WGM12))
+
+#ifdef OCR1C
+#define OCR1C_REGISTER &OCR1C
+#define TIMER1C_OUTPUT TIMER1C
 #else
-// The CONFIGURE_TIMER_REGISTERS macro needs to be set differently depending
-// upon which hardware timer is being used for the modulated pin. For most
-// Arduino boards this is going to be TIMER2B, but others are possible.
-// TODO: support other timers.
-#error Timer not supported.
+#define OCR1C_REGISTER 0
+#define TIMER1C_OUTPUT NOT_ON_TIMER
+#endif
+
+// Timer1 is taken over by the GK_TIME_TICK time base and by the schedule's
+// interrupt mode
+#if defined(TCCR1A) && GK_TIME_BASE != GK_TIME_TICK && !GK_SCHEDULE_INTERRUPT
+#define MODULATION_TIMER1
+#endif
+
+static const ModulationTimer timers[] = {
+#ifdef MODULATION_TIMER1
+    {
+        &TCCR1A, &TCCR1B, &TCNT1, &ICR1,
+        {&OCR1A, &OCR1B, OCR1C_REGISTER},
+        {TIMER1A, TIMER1B, TIMER1C_OUTPUT},
+        true, WGM_16BIT_A, WGM_16BIT_B
+    },
+#endif
+#ifdef TCCR2A
+    {
+        &TCCR2A, &TCCR2B, &TCNT2, &OCR2A,
+        {0, &OCR2B, 0},
+        {NOT_ON_TIMER, TIMER2B, NOT_ON_TIMER},
+        false, _BV(WGM21) | _BV(WGM20), _BV(WGM22)
+    },
+#endif
+#ifdef TCCR3A
+    {
+        &TCCR3A, &TCCR3B, &TCNT3, &ICR3,
+        {&OCR3A, &OCR3B, &OCR3C},
+        {TIMER3A, TIMER3B, TIMER3C},
+        true, WGM_16BIT_A, WGM_16BIT_B
+    },
 #endif
+#ifdef ICR4 // Timer4 on the ATmega32U4 is a different, 10-bit timer
+    {
+        &TCCR4A, &TCCR4B, &TCNT4, &ICR4,
+        {&OCR4A, &OCR4B, &OCR4C},
+        {TIMER4A, TIMER4B, TIMER4C},
+        true, WGM_16BIT_A, WGM_16BIT_B
+    },
+#endif
+#ifdef TCCR5A
+    {
+        &TCCR5A, &TCCR5B, &TCNT5, &ICR5,
+        {&OCR5A, &OCR5B, &OCR5C},
+        {TIMER5A, TIMER5B, TIMER5C},
+        true, WGM_16BIT_A, WGM_16BIT_B
+    },
+#endif
+};
+
+#define NUM_TIMERS (sizeof(timers) / sizeof(timers[0]))
+
+// Prescaler divisors, as powers of two, in clock select order (CSn = index+1)
+static const uint8_t wide_prescalers[] = {0, 3, 6, 8, 10};
+static const uint8_t narrow_prescalers[] = {0, 3, 5, 6, 7, 8, 10};
+
+// The current carrier of each timer. A clock select of 0 means it hasn't been
+// set up yet.
+static uint8_t clock_selects[NUM_TIMERS ? NUM_TIMERS : 1];
+static uint32_t periods[NUM_TIMERS ? NUM_TIMERS : 1]; // in timer counts
+static uint8_t duties[NUM_TIMERS ? NUM_TIMERS : 1][3];
+
+// Whether Timer2 is reserved by gk_modulation_reserve_timer2
+static bool timer2_reserved = false;
+
+// The COMnx1 bit of each output in TCCRnA; with COMnx0 clear, the output is
+// non-inverting
+#define COMPARE_OUTPUT_BIT(output) (0x80 >> (2 * (output)))
+
+// Find the timer and output driving a pin, returning false if it has none, or
+// if its timer is reserved
+static bool find_output(gkPin pin, uint8_t *timer, uint8_t *output) {
+    uint8_t id = digitalPinToTimer(pin);
+    if (id == NOT_ON_TIMER || (timer2_reserved && id == TIMER2B))
+        return false;
+    for (uint8_t ind = 0; ind < NUM_TIMERS; ++ind) {
+        for (uint8_t out = 0; out < 3; ++out) {
+            if (timers[ind].outputs[out] == id) {
+                *timer = ind;
+                *output = out;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool is_modulated(gkPin pin) {
+    gkPinDriver driver;
+    return gk_pin_get_driver(pin, &driver)
+        && driver.write == gk_pin_write_modulator;
+}
+
+static void write_register(const ModulationTimer *t, volatile void *reg,
+        uint16_t value) {
+    if (t->wide)
+        *(volatile uint16_t *)reg = value;
+    else
+        *(volatile uint8_t *)reg = (uint8_t)value;
+}
+
+// Get the compare value for a duty cycle of duty/256. The output is on for
+// compare+1 counts of each period, so very short duty cycles get one count.
+static uint16_t compare_value(uint32_t period, uint8_t duty) {
+    uint32_t on_counts = (period * duty + 128) >> 8;
+    return on_counts ? on_counts - 1 : 0;
+}
+
+static uint32_t achieved_frequency(uint8_t timer) {
+    if (!clock_selects[timer])
+        return 0;
+    const uint8_t *prescalers = timers[timer].wide ?
+            wide_prescalers : narrow_prescalers;
+    float frequency = F_CPU * 1000.0f /
+            ((float)periods[timer] * (1UL << prescalers[clock_selects[timer]-1]));
+    if (frequency >= 4294967295.0f)
+        return 0xFFFFFFFF;
+    return (uint32_t)(frequency + 0.5f);
+}
+
+static uint32_t set_carrier(uint8_t timer, uint8_t output,
+        uint32_t frequency_mhz, uint8_t duty) {
+    const ModulationTimer *t = &timers[timer];
+    const uint8_t *prescalers = t->wide ? wide_prescalers : narrow_prescalers;
+    uint8_t num_prescalers = t->wide ?
+            sizeof(wide_prescalers) : sizeof(narrow_prescalers);
+    uint32_t max_period = t->wide ? 0x10000UL : 0x100;
+
+    // Try each prescaler with the nearest period it allows, keeping the one
+    // with the smallest error. On ties, the smaller prescaler wins, since it
+    // gives the duty cycle a finer resolution.
+    float ideal = F_CPU * 1000.0f / frequency_mhz; // in CPU clocks
+    uint8_t best_select = num_prescalers;
+    uint32_t best_period = max_period;
+    float best_error = -1;
+    for (uint8_t ind = 0; ind < num_prescalers; ++ind) {
+        float divisor = (float)(1UL << prescalers[ind]);
+        float counts = ideal / divisor;
+        if (counts >= max_period + 0.5f)
+            continue;
+        uint32_t period = (uint32_t)(counts + 0.5f);
+        if (period < 2)
+            period = 2;
+        float error = ideal - period * divisor;
+        if (error < 0)
+            error = -error;
+        if (best_error < 0 || error < best_error) {
+            best_error = error;
+            best_select = ind + 1;
+            best_period = period;
+        }
+    }
+
+    uint8_t SREG_orig = SREG;
+    cli();
+    clock_selects[timer] = best_select;
+    periods[timer] = best_period;
+    duties[timer][output] = duty;
+    // Stop the timer while changing its period, then restart it from zero, so
+    // that the count can't be left above a new, lower TOP
+    *t->control_b = 0;
+    *t->control_a = (*t->control_a & 0xFC) | t->wgm_a;
+    write_register(t, t->top, best_period - 1);
+    for (uint8_t out = 0; out < 3; ++out) {
+        if (t->compare[out])
+            write_register(t, t->compare[out],
+                    compare_value(best_period, duties[timer][out]));
+    }
+    write_register(t, t->counter, 0);
+    *t->control_b = t->wgm_b | best_select;
+    SREG = SREG_orig;
+
+    return achieved_frequency(timer);
+}
+
+static void set_duty(uint8_t timer, uint8_t output, uint8_t duty) {
+    uint8_t SREG_orig = SREG;
+    cli();
+    duties[timer][output] = duty;
+    write_register(&timers[timer], timers[timer].compare[output],
+            compare_value(periods[timer], duty));
+    SREG = SREG_orig;
+}
 
 void gk_modulation_setup(void) {
     gkPin pin = 0;
     for (pin; pin < NUM_DIGITAL_PINS; ++pin) {
         if (digitalPinToTimer(pin) == MODULATION_TIMER) {
-            modulated_pin = pin;
             break;
         }
     }
     if (pin==NUM_DIGITAL_PINS)
         return; // No modulated pin found!
+    if (gk_modulation_configure(pin))
+        modulated_pin = pin;
+}
+
+bool gk_modulation_configure(gkPin pin) {
+    uint8_t timer, output;
+    if (!find_output(pin, &timer, &output))
+        return false;
 
     uint8_t pin_port = digitalPinToPort(pin);
     uint8_t pin_bit = digitalPinToBitMask(pin);
@@ -47,25 +244,89 @@ void gk_modulation_setup(void) {
     gkPinAction orig_level = (*out_reg & pin_bit) ?
             GK_PIN_WRITE_ON : GK_PIN_WRITE_OFF;
 
-    // Threshold values could probably be calculated a little more flexibly
-    // but this will work okay for now.
-    modulator_threshold_a = F_CPU / 2000 / CARRIER_FREQUENCY_KHZ;
-    modulator_threshold_b = modulator_threshold_a / CARRIER_DUTY_DIVISOR;
+    if (!clock_selects[timer]) {
+        set_carrier(timer, output, CARRIER_FREQUENCY_KHZ * 1000UL,
+                256 / CARRIER_DUTY_DIVISOR);
+    } else if (!duties[timer][output]) {
+        // Another output already set the carrier; give this one the default
+        // duty cycle
+        set_duty(timer, output, 256 / CARRIER_DUTY_DIVISOR);
+    }
+    if (is_modulated(pin))
+        return true; // Already modulated; keep its mode and level
+
+    if (!gk_pin_configure_modulator(pin))
+        return false;
+    gk_pin_set_mode_modulator(pin, orig_mode, orig_level);
+    return true;
+}
+
+void gk_modulation_release(gkPin pin) {
+    uint8_t timer, output;
+    if (!is_modulated(pin) || !find_output(pin, &timer, &output))
+        return;
+
+    uint8_t pin_port = digitalPinToPort(pin);
+    uint8_t pin_bit = digitalPinToBitMask(pin);
+    gkPinMode mode = (*portModeRegister(pin_port) & pin_bit) ?
+            GK_PIN_MODE_OUTPUT : GK_PIN_MODE_INPUT;
+    // A modulated output that is on should stay on
+    gkPinAction level = (mode == GK_PIN_MODE_OUTPUT) ?
+            ((*timers[timer].control_a & COMPARE_OUTPUT_BIT(output)) ?
+                GK_PIN_WRITE_ON : GK_PIN_WRITE_OFF) :
+            ((*portOutputRegister(pin_port) & pin_bit) ?
+                GK_PIN_WRITE_ON : GK_PIN_WRITE_OFF);
 
     uint8_t SREG_orig = SREG;
     cli();
-    *mode_reg |= pin_bit;
-    *out_reg &= ~pin_bit;
-    CONFIGURE_TIMER_REGISTERS;
+    *timers[timer].control_a &= ~COMPARE_OUTPUT_BIT(output);
+    gk_pin_configure_simple(pin);
+    gk_pin_set_mode_simple(pin, mode, level);
     SREG = SREG_orig;
+    if (modulated_pin == pin)
+        modulated_pin = NO_MODULATED_PIN;
+}
 
-    gk_pin_configure_modulator(pin);
-/*
-    gk_pin_set_mode_setter(pin, &gk_pin_set_mode_modulator);
-    gk_pin_set_writer(pin, &gk_pin_write_modulator);
-    gk_pin_set_reader(pin, &gk_pin_read_simple);
-*/
-    gk_pin_set_mode_modulator(pin, orig_mode, orig_level);
+uint32_t gk_modulation_set_carrier(
+    gkPin pin,
+    uint32_t frequency_mhz,
+    uint8_t duty
+) {
+    uint8_t timer, output;
+    if (!frequency_mhz || !find_output(pin, &timer, &output))
+        return 0;
+    return set_carrier(timer, output, frequency_mhz, duty);
+}
+
+uint32_t gk_modulation_frequency(gkPin pin) {
+    uint8_t timer, output;
+    if (!find_output(pin, &timer, &output))
+        return 0;
+    return achieved_frequency(timer);
+}
+
+bool gk_modulation_reserve_timer2(void) {
+#ifdef TCCR2A
+    for (gkPin pin = 0; pin < NUM_DIGITAL_PINS; ++pin) {
+        if (digitalPinToTimer(pin) == TIMER2B && is_modulated(pin))
+            return false;
+    }
+    timer2_reserved = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void gk_modulation_release_timer2(void) {
+    timer2_reserved = false;
+}
+
+static void set_timer_output(gkPin pin, gkPinAction level) {
+    uint8_t timer, output;
+    if (find_output(pin, &timer, &output))
+        gk_reg_setters[level](timers[timer].control_a,
+                COMPARE_OUTPUT_BIT(output));
 }
 
 // On mode set, the data direction register (DDR, "mode") must be set
@@ -80,7 +341,7 @@ void gk_pin_set_mode_modulator(gkPin pin, gkPinMode mode, gkPinAction level) {
     volatile uint8_t* mode_reg = portModeRegister(port);
 
     gkPinAction timer_action = (mode==GK_PIN_MODE_OUTPUT) ?
-            GK_PIN_WRITE_OFF : level;
+            level : GK_PIN_WRITE_OFF;
     gkPinAction output_action = (mode==GK_PIN_MODE_INPUT) ?
             level : GK_PIN_WRITE_OFF;
 
@@ -88,13 +349,20 @@ void gk_pin_set_mode_modulator(gkPin pin, gkPinMode mode, gkPinAction level) {
     cli();
     gk_reg_setters[mode](mode_reg, bit);
     gk_reg_setters[output_action](out_reg, bit);
-    SET_TIMER_OUTPUT(timer_action);
+    set_timer_output(pin, timer_action);
     SREG = SREG_orig;
 }
 
 void gk_pin_write_modulator(gkPin pin, gkPinAction level) {
     uint8_t SREG_orig = SREG;
     cli();
-    SET_TIMER_OUTPUT(level);
+    set_timer_output(pin, level);
     SREG=SREG_orig;
 }
+
+GK_PIN_DRIVER(
+    gk_pin_driver_modulator,
+    gk_pin_set_mode_modulator,
+    gk_pin_write_modulator,
+    gk_pin_read_simple
+);
@@ -2,6 +2,17 @@
 Digital pin I/O functions (mode set, read, and write) for using a PWM pin as a
 modulated I/O pin. This can, for example, allow the digital output of a pin to
 be modulated on a carrier wave for use with infrared communications.
+
+The carrier is produced entirely by a hardware timer in fast PWM mode, so it
+costs no CPU time; writing the pin on or off just connects or disconnects the
+timer's output. Supported outputs are the B output of Timer2 (whose A output
+register sets the carrier period), and the A, B and C outputs of the 16-bit
+Timers 1, 3, 4 and 5, wherever the chip has them. Timer0 is never used, since
+it drives millis() and micros(), and Timer1 is not available with the
+GK_TIME_TICK time base or GK_SCHEDULE_INTERRUPT, which take it over. All of the
+outputs of a timer share its carrier frequency, but each has its own duty
+cycle. Modulating a pin stops analogWrite() from working properly on the other
+pins of the same timer.
 */
 #ifndef MODULATION_H
 #define MODULATION_H
@@ -31,18 +42,45 @@ uint8_t modulated_pin = NO_MODULATED_PIN;
 extern uint8_t modulated_pin;
 #endif
 
+// Set up the pin driven by MODULATION_TIMER as a modulated pin with the
+// default carrier, and store it in modulated_pin
 void gk_modulation_setup(void);
 
+// Make a pin a modulated pin, keeping its current mode and level. If its
+// timer's carrier hasn't been set yet, it starts out at CARRIER_FREQUENCY_KHZ,
+// with a duty cycle of 1/CARRIER_DUTY_DIVISOR. Returns false (changing
+// nothing) if the pin has no supported timer output.
+bool gk_modulation_configure(gkPin pin);
+// Stop modulating a pin, returning it to the simple pin functions
+void gk_modulation_release(gkPin pin);
+// Set the carrier of a pin's timer to the frequency, in millihertz, that can
+// be produced most closely, and the duty cycle of the pin's output to
+// duty/256. The prescaler and period are chosen to minimize the frequency
+// error; the frequency is shared by all pins on the same timer. Returns the
+// frequency actually produced, in millihertz, or 0 if the pin has no supported
+// timer output or frequency_mhz is 0.
+uint32_t gk_modulation_set_carrier(
+    gkPin pin,
+    uint32_t frequency_mhz,
+    uint8_t duty
+);
+// Get the carrier frequency currently produced for a pin, in millihertz, or 0
+// if there is none
+uint32_t gk_modulation_frequency(gkPin pin);
+// Keep Timer2 for another use, such as the sampler (gkutil/sampler.h), until
+// gk_modulation_release_timer2: its pins can't be modulated meanwhile. Returns
+// false, reserving nothing, if a pin on Timer2 is being modulated or the chip
+// has no Timer2.
+bool gk_modulation_reserve_timer2(void);
+void gk_modulation_release_timer2(void);
+
 void gk_pin_set_mode_modulator(gkPin, gkPinMode, gkPinAction);
 void gk_pin_write_modulator(gkPin, gkPinAction);
 
+extern const gkPinDriver gk_pin_driver_modulator PROGMEM;
+
 #define gk_pin_configure_modulator(pin) \
-    gk_pin_configure( \
-        pin, \
-        gk_pin_set_mode_modulator, \
-        gk_pin_write_modulator, \
-        gk_pin_read_simple \
-    )
+    gk_pin_set_driver(pin, &gk_pin_driver_modulator)
 
 #ifdef __cplusplus
 }
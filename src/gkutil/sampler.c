@@ -0,0 +1,257 @@
+#include "gkutil.h"
+#include "sampler.h"
+#include "modulation.h"
+
+/*
+Timer2 runs in CTC mode, with OCR2A as TOP, and each compare match takes a
+sample: the input register of every sampled port, masked to the selected
+pins, copied into the next slot of the ring. The ring has a single producer
+(the interrupt) and a single consumer (gk_sampler_read, in the main loop); the
+interrupt only writes `sampler_tail`, and the consumer takes samples with
+interrupts disabled, so that the sample numbers stay in step.
+
+The samples in the ring are always consecutive, the oldest being number
+`sampler_first_index`. When the ring fills up, the interrupt stops queueing
+samples until the consumer has emptied it, then starts again with
+`sampler_first_index` set to the number of the sample it is taking, so that
+there is at most one gap, and it is always between the ring's contents and
+the next sample queued.
+*/
+
+// Pins selected for sampling, by port
+uint8_t sampler_port_masks[GK_NUM_PORTS + 1] = {0};
+
+// The input registers of the sampled ports, and their masks, in sample order
+volatile uint8_t* sampler_inputs[GK_NUM_PORTS];
+uint8_t sampler_masks[GK_NUM_PORTS];
+uint8_t sampler_width = 0;
+
+uint8_t sampler_buffer[GK_SAMPLER_BUFFER_SIZE];
+// End of the whole samples that fit in the buffer, and the ring's first and
+// next free bytes
+uint16_t sampler_buffer_end = 0;
+volatile uint16_t sampler_head = 0;
+volatile uint16_t sampler_tail = 0;
+volatile uint32_t sampler_first_index = 0;
+volatile uint32_t sampler_next_index = 0;
+volatile bool sampler_overflowed = false;
+volatile uint16_t sampler_overflows = 0;
+
+bool sampler_running = false;
+gkTime sampler_start_time = 0;
+
+// Timer2 settings to restore when the sampler stops
+uint8_t sampler_saved_control_a;
+uint8_t sampler_saved_control_b;
+uint8_t sampler_saved_top;
+uint8_t sampler_saved_interrupts;
+
+// Prescaler divisors of Timer2, as powers of two, in clock select order
+// (CS2 = index+1)
+static const uint8_t prescalers[] = {0, 3, 5, 6, 7, 8, 10};
+
+// Take a sample. Called from the interrupt, or with interrupts disabled.
+static void sampler_take(void) {
+    uint32_t index = sampler_next_index++;
+    uint16_t tail = sampler_tail;
+    if (sampler_overflowed) {
+        if (sampler_head != tail) {
+            if (sampler_overflows < 0xFFFF)
+                ++sampler_overflows;
+            return;
+        }
+        sampler_overflowed = false;
+        sampler_first_index = index;
+    }
+    uint16_t next_tail = tail + sampler_width;
+    if (next_tail == sampler_buffer_end)
+        next_tail = 0;
+    if (next_tail == sampler_head) {
+        sampler_overflowed = true;
+        if (sampler_overflows < 0xFFFF)
+            ++sampler_overflows;
+        return;
+    }
+    uint8_t* slot = sampler_buffer + tail;
+    for (uint8_t ind = 0; ind < sampler_width; ++ind)
+        slot[ind] = *sampler_inputs[ind] & sampler_masks[ind];
+    sampler_tail = next_tail;
+}
+
+#ifdef TCCR2A
+ISR(TIMER2_COMPA_vect) {
+    sampler_take();
+}
+#endif
+
+void gk_sampler_clear_pins(void) {
+    if (sampler_running)
+        return;
+    memset(sampler_port_masks, 0, sizeof(sampler_port_masks));
+}
+
+bool gk_sampler_add_pin(gkPin pin) {
+    if (sampler_running || pin >= GK_NUM_PINS)
+        return false;
+    gkPort port = digitalPinToPort(pin);
+    if (!port || port > GK_NUM_PORTS)
+        return false;
+    sampler_port_masks[port] |= digitalPinToBitMask(pin);
+    return true;
+}
+
+uint8_t gk_sampler_width(void) {
+    return sampler_width;
+}
+
+uint8_t gk_sampler_pin_position(gkPin pin) {
+    if (pin >= GK_NUM_PINS)
+        return GK_NOT_A_PIN;
+    gkPort pin_port = digitalPinToPort(pin);
+    uint8_t bit_mask = digitalPinToBitMask(pin);
+    if (!pin_port || pin_port > GK_NUM_PORTS
+            || !(sampler_port_masks[pin_port] & bit_mask))
+        return GK_NOT_A_PIN;
+    uint8_t byte = 0;
+    for (gkPort port = 1; port < pin_port; ++port) {
+        if (sampler_port_masks[port])
+            ++byte;
+    }
+    uint8_t bit = 0;
+    while (!(bit_mask & (1 << bit)))
+        ++bit;
+    return byte * 8 + bit;
+}
+
+uint32_t gk_sampler_start(uint32_t rate_mhz) {
+#ifdef TCCR2A
+    uint8_t width = 0;
+    for (gkPort port = 1; port <= GK_NUM_PORTS; ++port) {
+        if (sampler_port_masks[port])
+            ++width;
+    }
+    if (sampler_running || !width || width > GK_SAMPLER_BUFFER_SIZE / 2
+            || !rate_mhz || rate_mhz > GK_SAMPLER_MAX_RATE_MHZ)
+        return 0;
+
+    // The smallest prescaler that can count out the period gives the rate
+    // closest to the one asked for
+    float ideal = F_CPU * 1000.0f / rate_mhz; // in CPU clocks
+    uint8_t select = 0;
+    uint16_t period = 0;
+    for (uint8_t ind = 0; ind < sizeof(prescalers); ++ind) {
+        float counts = ideal / (float)(1UL << prescalers[ind]);
+        if (counts < 256.5f) {
+            select = ind + 1;
+            period = (uint16_t)(counts + 0.5f);
+            break;
+        }
+    }
+    if (!select || !period || !gk_modulation_reserve_timer2())
+        return 0;
+
+    sampler_width = 0;
+    for (gkPort port = 1; port <= GK_NUM_PORTS; ++port) {
+        if (!sampler_port_masks[port])
+            continue;
+        sampler_inputs[sampler_width] = portInputRegister(port);
+        sampler_masks[sampler_width] = sampler_port_masks[port];
+        ++sampler_width;
+    }
+    sampler_buffer_end = GK_SAMPLER_BUFFER_SIZE / width * width;
+
+    uint8_t SREG_orig = SREG;
+    cli();
+    sampler_saved_control_a = TCCR2A;
+    sampler_saved_control_b = TCCR2B;
+    sampler_saved_top = OCR2A;
+    sampler_saved_interrupts = TIMSK2;
+    TCCR2B = 0;
+    TCCR2A = _BV(WGM21); // CTC mode, with the outputs disconnected
+    OCR2A = period - 1;
+    TCNT2 = 0;
+    TIFR2 = _BV(OCF2A);
+    TIMSK2 |= _BV(OCIE2A);
+
+    sampler_head = 0;
+    sampler_tail = 0;
+    sampler_first_index = 0;
+    sampler_next_index = 0;
+    sampler_overflowed = false;
+    sampler_overflows = 0;
+    sampler_take();
+    sampler_start_time = gk_time_now();
+    TCCR2B = select;
+    sampler_running = true;
+    SREG = SREG_orig;
+
+    return (uint32_t)(F_CPU * 1000.0f
+        / ((float)period * (1UL << prescalers[select - 1])) + 0.5f);
+#else
+    return 0;
+#endif
+}
+
+void gk_sampler_stop(void) {
+#ifdef TCCR2A
+    if (!sampler_running)
+        return;
+    uint8_t SREG_orig = SREG;
+    cli();
+    TCCR2B = 0;
+    TIMSK2 = sampler_saved_interrupts;
+    TIFR2 = _BV(OCF2A);
+    OCR2A = sampler_saved_top;
+    TCCR2A = sampler_saved_control_a;
+    TCCR2B = sampler_saved_control_b;
+    sampler_running = false;
+    SREG = SREG_orig;
+    gk_modulation_release_timer2();
+#endif
+}
+
+bool gk_sampler_running(void) {
+    return sampler_running;
+}
+
+gkTime gk_sampler_start_time(void) {
+    return sampler_start_time;
+}
+
+uint16_t gk_sampler_queued(void) {
+    uint8_t SREG_orig = SREG;
+    cli();
+    uint16_t head = sampler_head;
+    uint16_t tail = sampler_tail;
+    SREG = SREG_orig;
+    if (!sampler_width)
+        return 0;
+    if (tail >= head)
+        return (tail - head) / sampler_width;
+    else
+        return (sampler_buffer_end - head + tail) / sampler_width;
+}
+
+bool gk_sampler_read(uint8_t* sample, uint32_t* index) {
+    uint8_t SREG_orig = SREG;
+    cli();
+    uint16_t head = sampler_head;
+    if (head == sampler_tail) {
+        SREG = SREG_orig;
+        return false;
+    }
+    memcpy(sample, sampler_buffer + head, sampler_width);
+    *index = sampler_first_index++;
+    head += sampler_width;
+    sampler_head = (head == sampler_buffer_end) ? 0 : head;
+    SREG = SREG_orig;
+    return true;
+}
+
+uint16_t gk_sampler_overflows(void) {
+    uint8_t SREG_orig = SREG;
+    cli();
+    uint16_t overflows = sampler_overflows;
+    SREG = SREG_orig;
+    return overflows;
+}
@@ -0,0 +1,82 @@
+/* sampler.h
+Fixed-rate sampling of digital inputs, for when a regularly sampled record is
+needed rather than the changes reported by listeners. A Timer2 compare-match
+interrupt reads the input registers of the ports holding the selected pins at
+a steady rate, from about 61 Hz to GK_SAMPLER_MAX_RATE_MHZ, and queues each
+sample in a ring buffer, to be read from the main loop with gk_sampler_read.
+
+A sample holds one byte for each port with selected pins, in port order, with
+the bits of the other pins cleared (see gk_sampler_pin_position). Samples are
+numbered from 0, which gk_sampler_start takes itself; sample n was taken
+n * 1000 / rate_mhz seconds after it. If the buffer fills up, samples are
+dropped (and counted) until it has been emptied, and the numbers of the
+samples read show the gap.
+
+The sampler takes over Timer2 while it runs, restoring its settings when it
+stops. Pins on Timer2 can't be modulated meanwhile (see gkutil/modulation.h),
+and analogWrite on them (pins 3 and 11 on the Uno) won't work. This file
+defines the Timer2 compare-match interrupt handler, so it can't be linked into
+a sketch that uses tone(). It needs a chip with a Timer2, so isn't available on
+the ATmega32U4.
+*/
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "gkutil.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Size of the ring buffer of samples, in bytes. Override with a compiler flag
+// if desired; it must be from 2 to 32767.
+#ifndef GK_SAMPLER_BUFFER_SIZE
+#if RAMEND > 0x1000
+#define GK_SAMPLER_BUFFER_SIZE 1024
+#else
+#define GK_SAMPLER_BUFFER_SIZE 128
+#endif
+#endif
+
+#if GK_SAMPLER_BUFFER_SIZE < 2 || GK_SAMPLER_BUFFER_SIZE > 32767
+#error GK_SAMPLER_BUFFER_SIZE must be from 2 to 32767
+#endif
+
+// Fastest sampling rate, in millihertz
+#define GK_SAMPLER_MAX_RATE_MHZ 20000000UL
+
+// Choose the pins to sample, while the sampler is stopped. gk_sampler_add_pin
+// returns false if the pin doesn't exist or the sampler is running.
+void gk_sampler_clear_pins(void);
+bool gk_sampler_add_pin(gkPin pin);
+// Bytes in each sample, as of the last gk_sampler_start
+uint8_t gk_sampler_width(void);
+// Where a pin's level is in each sample: the byte, times 8, plus the bit; or
+// GK_NOT_A_PIN if the pin isn't being sampled
+uint8_t gk_sampler_pin_position(gkPin pin);
+
+// Start sampling the selected pins at the rate nearest to rate_mhz that
+// Timer2 can produce, taking sample 0 straight away. Returns the rate actually
+// produced, in millihertz, or 0 (changing nothing) if no pins are selected,
+// the rate is out of range, Timer2 is in use, or the sampler is already
+// running.
+uint32_t gk_sampler_start(uint32_t rate_mhz);
+void gk_sampler_stop(void);
+bool gk_sampler_running(void);
+// Time at which sample 0 was taken
+gkTime gk_sampler_start_time(void);
+
+// Number of samples waiting in the buffer
+uint16_t gk_sampler_queued(void);
+// Take the oldest sample from the buffer, copying gk_sampler_width() bytes
+// into sample and its number into index. Returns false if there is none.
+bool gk_sampler_read(uint8_t* sample, uint32_t* index);
+// Get the number of samples dropped because the buffer was full, since the
+// sampler was started
+uint16_t gk_sampler_overflows(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
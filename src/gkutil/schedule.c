@@ -4,96 +4,605 @@
 #undef SCHEDULE_GLOBAL
 
 /*
-The event schedule is implemented as a dynamically-allocated singly-linked list.
-Initially I implemented it as a ring buffer, but when I realized that it would
-sometimes be necessary to remove items from the middle of the list rather than
-only from the front, it seemed easier and less error-prone to just use a linked
-list. Not sure if in the end, using a ring buffer is a better idea for
-performance reasons, but the linked list approach has worked for me on the
-Arduino in the past so hopefully it will hold up.
+The event schedule was originally a dynamically-allocated doubly-linked list,
+but with a linear-time insert and a malloc for every event, a long pulse train
+took quadratic time to schedule and fragmented the (tiny) heap. It is now a
+binary min-heap over a statically allocated pool of nodes, so adding an event
+or removing the next one due takes logarithmic time and never allocates.
+
+In interrupt mode, events are executed from the Timer1 compare-match B
+interrupt. Timer1 runs freely at F_CPU/64 and OCR1B is armed for when the next
+event is due, so the only interrupts taken are those that actually have work to
+do (plus a short polling tail with the millis() time base, since millis() is
+not in phase with Timer1). With the GK_TIME_TICK time base, Timer1 is already
+counting out ticks, so OCR1B is left matching at the start of each tick and
+the interrupt is simply enabled whenever any events are pending. Every change
+to the heap is made with interrupts disabled.
+
+Events due at the same time on pins whose drivers write with
+gk_pin_write_simple (inverted or not) are coalesced into a single
+gk_port_update per port, so that pins on the same port that are scheduled
+together change on exactly the same clock cycle. Other pins are written one at
+a time with gk_pin_write, as usual.
+
+All comparisons of event times go through gk_time_before, so the ordering stays
+correct when the clock wraps around.
+
+Nodes never move once allocated, so a gkScheduleIterator (a node pointer) stays
+meaningful as the heap is reshuffled; each node records its current position
+in the heap. The heap array holds node indices: positions [0, length) are the
+heap itself, and positions [length, allocated) hold the indices of free nodes.
+Nodes at and beyond `allocated` have never been used, which lets the pool
+start out zeroed without any initialization step.
+
+The pending events on each pin are also threaded onto a doubly-linked list for
+that pin (newest first), along with a count and the latest time of any of them.
+This lets callers find when a pin will next be idle, or cancel everything
+pending on it, without searching the whole schedule. The latest time is only
+marked stale when the event holding it is removed, and recomputed from the
+pin's list the next time it is asked for, so that cancelling all of a pin's
+events stays linear in their number.
+
+Long or endless waveforms are produced by generators instead of being
+scheduled edge by edge. A generator keeps only one event in the heap, its next
+edge; when that edge is executed, the generator works out the one after it and
+schedules that in turn. Generators live in their own small static pool, and are
+freed when they finish, or when their pending edge is cancelled or removed.
 */
 
+#define NO_NODE 255
+
+#define GENERATOR_FREE 0
+#define GENERATOR_PULSE_TRAIN 1
+#define GENERATOR_BYTES 2
+
 typedef struct gkScheduleNode gkScheduleNode;
 
 struct gkScheduleNode {
     gkScheduledEvent event;
-    gkScheduleNode *next;
-    gkScheduleNode *prev;
+    // Insertion sequence number, to execute equal-time events in FIFO order
+    uint16_t order;
+    // Position of this node in sched.heap
+    uint8_t heap_pos;
+    // Neighbors in the list of pending events on the same pin
+    uint8_t pin_next;
+    uint8_t pin_prev;
+    // 1 + the index of the generator this is the next edge of, or 0 for an
+    // ordinary event
+    uint8_t generator;
 };
 
+typedef struct PinEvents {
+    // Latest time of any pending event on the pin, unless stale
+    gkTime last_time;
+    // First node in the pin's list; meaningless when count is 0
+    uint8_t head;
+    uint8_t count;
+    bool stale;
+} PinEvents;
+
+typedef struct Generator {
+    uint8_t kind;
+    // Whether the pending edge ends a pulse (rather than beginning one)
+    bool in_pulse;
+    gkTime pulse_start;
+    gkTime width;
+    union {
+        struct {
+            gkPinAction on_action;
+            gkPinAction off_action;
+            // Repeat until cancelled, or begin `remaining` more pulses after
+            // this one
+            bool forever;
+            uint16_t remaining;
+            gkTime period;
+            gkTime jitter;
+        } train;
+        struct {
+            gkTime bit_interval;
+            // The bit being sent, counting the leading and trailing 1-bits,
+            // out of num_bits
+            uint8_t bit;
+            uint8_t num_bits;
+            uint8_t data[GK_SCHEDULE_WRITE_MAX + 1];
+        } bytes;
+    };
+} Generator;
+
 struct Schedule {
-    gkScheduleNode *head;
-    gkScheduleNode *tail;
+    gkScheduleNode nodes[SCHEDULE_BUFFER_SIZE];
+    uint8_t heap[SCHEDULE_BUFFER_SIZE];
     uint8_t length;
+    uint8_t allocated;
+    uint16_t next_order;
+    uint16_t overflows;
+    PinEvents pins[GK_NUM_PINS];
+    Generator generators[SCHEDULE_GENERATORS];
+    // State of the xorshift random number generator used for jitter
+    uint32_t random;
+#if GK_SCHEDULE_STATS
+    gkScheduleStats stats;
+    // gk_time_fine() at the last call to gk_schedule_execute, if timing_loop
+    uint32_t last_execute;
+    bool timing_loop;
+#endif
 } sched = {0};
 
-uint8_t gk_schedule_add(gkTime time, gkPin pin, gkPinAction action) {
-    gkScheduleNode *new_node = (gkScheduleNode*)malloc(sizeof(gkScheduleNode));
-    if (!new_node) {
-        // Out of memory!
-        return 255;
+#define NODE_AT(pos) (&sched.nodes[sched.heap[pos]])
+
+#if GK_SCHEDULE_INTERRUPT
+#define SCHEDULE_LOCK() uint8_t SREG_orig = SREG; cli()
+#define SCHEDULE_UNLOCK() SREG = SREG_orig
+
+#if GK_TIME_BASE != GK_TIME_TICK
+// Timer1 counts per millisecond, with the timer running at F_CPU/64
+#define SCHEDULE_TIMER_COUNTS_PER_MS (F_CPU / 64 / 1000)
+// Timer1 counts for a wait of t gkTime units, rounded up
+#define SCHEDULE_TIMER_COUNTS(t) ( \
+    ((t) * SCHEDULE_TIMER_COUNTS_PER_MS + GK_TIME_PER_MS - 1) / GK_TIME_PER_MS \
+)
+#if GK_TIME_BASE == GK_TIME_MILLIS
+// millis() is not in phase with Timer1, so wake up 1 ms early and then poll
+// every ~64 us until it catches up
+#define SCHEDULE_TIMER_EARLY 1
+#define SCHEDULE_TIMER_POLL_COUNTS (F_CPU / 64 / 16000)
+#else
+// micros() runs from the same clock as Timer1, so wake up right when the event
+// is due and poll only if rounding left us slightly early
+#define SCHEDULE_TIMER_EARLY 0
+#define SCHEDULE_TIMER_POLL_COUNTS 4
+#endif
+// Longest wait that fits in a single arming of the 16-bit timer
+#define SCHEDULE_TIMER_MAX_WAIT ( \
+    (0xFFFFUL - SCHEDULE_TIMER_POLL_COUNTS) * GK_TIME_PER_MS \
+    / SCHEDULE_TIMER_COUNTS_PER_MS \
+)
+#endif
+
+static void schedule_arm(void);
+#else
+#define SCHEDULE_LOCK()
+#define SCHEDULE_UNLOCK()
+#endif
+
+// Whether node a is due to be executed before node b
+static inline bool node_before(gkScheduleNode *a, gkScheduleNode *b) {
+    if (a->event.time != b->event.time)
+        return gk_time_before(a->event.time, b->event.time);
+    return (int16_t)(a->order - b->order) < 0;
+}
+
+static inline void heap_place(uint8_t pos, uint8_t node_ind) {
+    sched.heap[pos] = node_ind;
+    sched.nodes[node_ind].heap_pos = pos;
+}
+
+// Move the node at heap position pos toward the root until the heap is valid
+static void heap_sift_up(uint8_t pos) {
+    uint8_t node_ind = sched.heap[pos];
+    gkScheduleNode *node = &sched.nodes[node_ind];
+    while (pos) {
+        uint8_t parent = (pos - 1) / 2;
+        if (!node_before(node, NODE_AT(parent)))
+            break;
+        heap_place(pos, sched.heap[parent]);
+        pos = parent;
     }
+    heap_place(pos, node_ind);
+}
+
+// Move the node at heap position pos toward the leaves until the heap is valid
+static void heap_sift_down(uint8_t pos) {
+    uint8_t node_ind = sched.heap[pos];
+    gkScheduleNode *node = &sched.nodes[node_ind];
+    for (;;) {
+        // Use a 16-bit index so that this can't overflow for large heaps
+        uint16_t child = 2 * (uint16_t)pos + 1;
+        if (child >= sched.length)
+            break;
+        if (child + 1 < sched.length
+                && node_before(NODE_AT(child + 1), NODE_AT(child)))
+            ++child;
+        if (!node_before(NODE_AT(child), node))
+            break;
+        heap_place(pos, sched.heap[child]);
+        pos = child;
+    }
+    heap_place(pos, node_ind);
+}
+
+// Add a newly scheduled node to the list for its pin
+static void pin_link(uint8_t node_ind) {
+    gkScheduleNode *node = &sched.nodes[node_ind];
+    if (node->event.pin >= GK_NUM_PINS)
+        return;
+    PinEvents *pin_events = &sched.pins[node->event.pin];
+    node->pin_prev = NO_NODE;
+    if (pin_events->count) {
+        node->pin_next = pin_events->head;
+        sched.nodes[pin_events->head].pin_prev = node_ind;
+        if (gk_time_after(node->event.time, pin_events->last_time))
+            pin_events->last_time = node->event.time;
+    } else {
+        node->pin_next = NO_NODE;
+        pin_events->last_time = node->event.time;
+        pin_events->stale = false;
+    }
+    pin_events->head = node_ind;
+    ++pin_events->count;
+}
+
+// Remove a node from the list for its pin
+static void pin_unlink(uint8_t node_ind) {
+    gkScheduleNode *node = &sched.nodes[node_ind];
+    if (node->event.pin >= GK_NUM_PINS)
+        return;
+    PinEvents *pin_events = &sched.pins[node->event.pin];
+    if (node->pin_prev != NO_NODE)
+        sched.nodes[node->pin_prev].pin_next = node->pin_next;
+    else
+        pin_events->head = node->pin_next;
+    if (node->pin_next != NO_NODE)
+        sched.nodes[node->pin_next].pin_prev = node->pin_prev;
+    --pin_events->count;
+    if (node->event.time == pin_events->last_time)
+        pin_events->stale = true;
+}
+
+// Take the node at heap position pos out of the heap and return it to the
+// pool of free nodes
+static void heap_remove(uint8_t pos) {
+    uint8_t node_ind = sched.heap[pos];
+    pin_unlink(node_ind);
+    uint8_t last = --sched.length;
+    if (pos != last) {
+        heap_place(pos, sched.heap[last]);
+        if (pos && node_before(NODE_AT(pos), NODE_AT((pos - 1) / 2)))
+            heap_sift_up(pos);
+        else
+            heap_sift_down(pos);
+    }
+    // The freed node goes just past the end of the heap
+    heap_place(last, node_ind);
+}
+
+// Take a node out of the heap for good, freeing its generator if it has one
+static void heap_discard(uint8_t pos) {
+    uint8_t generator = NODE_AT(pos)->generator;
+    if (generator)
+        sched.generators[generator - 1].kind = GENERATOR_FREE;
+    heap_remove(pos);
+}
+
+// Add an event to the heap. Must be called with the schedule locked.
+static uint8_t schedule_insert(
+        gkTime time,
+        gkPin pin,
+        gkPinAction action,
+        uint8_t generator) {
+    if (sched.length >= SCHEDULE_BUFFER_SIZE) {
+        if (sched.overflows < 0xFFFF)
+            ++sched.overflows;
+        return GK_SCHEDULE_FULL;
+    }
+    if (sched.length == sched.allocated) {
+        // No free nodes to recycle, so take a fresh one from the pool
+        sched.heap[sched.length] = sched.allocated++;
+    }
+    uint8_t pos = sched.length++;
+    uint8_t node_ind = sched.heap[pos];
+    gkScheduleNode *new_node = &sched.nodes[node_ind];
     new_node->event.time = time;
     new_node->event.pin = pin;
     new_node->event.action = action;
-    new_node->next = 0;
-
-    if (sched.head) {
-        // This is not the only item in the schedule
-        gkScheduleNode *before = 0;
-        gkScheduleNode *after = sched.head;
-        while (after && after->event.time < time) {
-            before = after;
-            after = before->next;
+    new_node->order = sched.next_order++;
+    new_node->generator = generator;
+    new_node->heap_pos = pos;
+    heap_sift_up(pos);
+    pin_link(node_ind);
+#if GK_SCHEDULE_STATS
+    if (sched.length > sched.stats.peak_size)
+        sched.stats.peak_size = sched.length;
+#endif
+#if GK_SCHEDULE_INTERRUPT
+    if (new_node->heap_pos == 0)
+        schedule_arm();
+#endif
+    return sched.length;
+}
+
+static uint32_t schedule_random(void) {
+    uint32_t x = sched.random ? sched.random : 2463534242UL;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sched.random = x;
+    return x;
+}
+
+// Whether bit number `bit` of a byte write is a 1, counting the leading and
+// trailing 1-bits
+static bool bytes_bit(Generator *gen, uint8_t bit) {
+    if (!bit || bit == gen->bytes.num_bits - 1)
+        return true;
+    --bit;
+    return gen->bytes.data[bit / 8] & (1 << (bit % 8));
+}
+
+// Schedule the edge following the one a generator just produced, or free the
+// generator if it has finished. Must be called with the schedule locked.
+static void generator_advance(uint8_t generator, gkPin pin) {
+    Generator *gen = &sched.generators[generator - 1];
+    gkTime time;
+    gkPinAction action;
+    switch (gen->kind) {
+    case GENERATOR_PULSE_TRAIN:
+        if (!gen->in_pulse) {
+            // The pulse just began; end it
+            time = gen->pulse_start + gen->width;
+            action = gen->train.off_action;
+            gen->in_pulse = true;
+            break;
         }
-        // `after` is now the first node with a time greater than the new node's
-        // time, or null if the new node should be at the end, and `before` is
-        // the last node with a time less than the new node's time, or null if
-        // the new node should be at the start
-        new_node->next = after;
-        new_node->prev = before;
-        if (before) {
-            before->next = new_node;
-        } else {
-            sched.head = new_node;
+        if (!gen->train.forever && !gen->train.remaining--) {
+            gen->kind = GENERATOR_FREE;
+            return;
         }
-        if (after) {
-            after->prev = new_node;
-        } else {
-            sched.tail = new_node;
+        gen->pulse_start += gen->train.period;
+        if (gen->train.jitter)
+            gen->pulse_start += schedule_random() % (gen->train.jitter + 1);
+        time = gen->pulse_start;
+        action = gen->train.on_action;
+        gen->in_pulse = false;
+        break;
+    case GENERATOR_BYTES:
+        action = GK_PIN_WRITE_TOGGLE;
+        if (!gen->in_pulse) {
+            // A 1-bit just began; end it
+            time = gen->pulse_start + gen->width;
+            gen->in_pulse = true;
+            break;
         }
-        ++sched.length;
-    } else {
-        // This is now the only item in the schedule
-        sched.head = new_node;
-        sched.tail = new_node;
-        sched.length = 1;
+        // Skip ahead to the next 1-bit, if there are any left
+        do {
+            if (++gen->bytes.bit == gen->bytes.num_bits) {
+                gen->kind = GENERATOR_FREE;
+                return;
+            }
+            gen->pulse_start += gen->bytes.bit_interval;
+        } while (!bytes_bit(gen, gen->bytes.bit));
+        time = gen->pulse_start;
+        gen->in_pulse = false;
+        break;
+    default:
+        return;
     }
-    return sched.length;
+    // There is always room, since the generator's last edge was just removed
+    schedule_insert(time, pin, action, generator);
+}
+
+// Claim a free generator of the given kind and schedule its first edge,
+// setting *length as for gk_schedule_add. Returns the generator, for the
+// caller to fill in the rest of its state, or 0 if there was no room (which
+// counts as an overflow). Must be called with the schedule locked.
+static Generator *generator_start(
+        uint8_t kind,
+        gkTime time,
+        gkPin pin,
+        gkPinAction action,
+        uint8_t *length) {
+    *length = GK_SCHEDULE_FULL;
+    for (uint8_t ind = 0; ind < SCHEDULE_GENERATORS; ++ind) {
+        Generator *gen = &sched.generators[ind];
+        if (gen->kind != GENERATOR_FREE)
+            continue;
+        *length = schedule_insert(time, pin, action, ind + 1);
+        if (*length == GK_SCHEDULE_FULL)
+            return 0;
+        gen->kind = kind;
+        return gen;
+    }
+    if (sched.overflows < 0xFFFF)
+        ++sched.overflows;
+    return 0;
+}
+
+void gk_schedule_setup(void) {
+#if GK_SCHEDULE_INTERRUPT
+    uint8_t SREG_orig = SREG;
+    cli();
+#if GK_TIME_BASE == GK_TIME_TICK
+    // Timer1 was set up by gk_setup(); match just after each tick begins
+    OCR1B = 0;
+#else
+    TCCR1A = 0;
+    TCCR1B = _BV(CS11) | _BV(CS10);
+#endif
+    TIMSK1 &= ~_BV(OCIE1B);
+    schedule_arm();
+    SREG = SREG_orig;
+#endif
+}
+
+uint8_t gk_schedule_add(gkTime time, gkPin pin, gkPinAction action) {
+    SCHEDULE_LOCK();
+    uint8_t length = schedule_insert(time, pin, action, 0);
+    SCHEDULE_UNLOCK();
+    return length;
+}
+
+uint8_t gk_schedule_pulse_train(
+        gkTime start,
+        gkPin pin,
+        gkPinAction on_action,
+        gkPinAction off_action,
+        gkTime period,
+        gkTime width,
+        uint16_t count,
+        gkTime jitter) {
+    uint8_t length;
+    // Each pulse must begin later than the last, or the train would never let
+    // the schedule move on
+    if (!period)
+        period = 1;
+    // Each pulse must also end before the next begins, or the two edges would
+    // coincide and the pin would never go off
+    if (count != 1 && width >= period)
+        width = period - 1;
+    // Event times must stay within 2^31 units of each other, which also keeps
+    // jitter + 1 from wrapping around to 0
+    if (jitter > 0x7FFFFFFF)
+        jitter = 0x7FFFFFFF;
+    SCHEDULE_LOCK();
+    Generator *gen = generator_start(
+        GENERATOR_PULSE_TRAIN, start, pin, on_action, &length);
+    if (gen) {
+        gen->in_pulse = false;
+        gen->pulse_start = start;
+        gen->width = width;
+        gen->train.on_action = on_action;
+        gen->train.off_action = off_action;
+        gen->train.forever = !count;
+        gen->train.remaining = count ? count - 1 : 0;
+        gen->train.period = period;
+        gen->train.jitter = jitter;
+    }
+    SCHEDULE_UNLOCK();
+    return length;
+}
+
+uint8_t gk_schedule_generators_available(void) {
+    uint8_t available = 0;
+    for (uint8_t ind = 0; ind < SCHEDULE_GENERATORS; ++ind) {
+        if (sched.generators[ind].kind == GENERATOR_FREE)
+            ++available;
+    }
+    return available;
+}
+
+void gk_schedule_seed(uint32_t seed) {
+    SCHEDULE_LOCK();
+    sched.random = seed;
+    SCHEDULE_UNLOCK();
 }
 
 uint8_t gk_schedule_size() {
     return sched.length;
 }
 
+uint8_t gk_schedule_available() {
+    return SCHEDULE_BUFFER_SIZE - sched.length;
+}
+
+uint16_t gk_schedule_overflows() {
+    return sched.overflows;
+}
+
+void gk_schedule_clear_overflows() {
+    sched.overflows = 0;
+}
+
+#if GK_SCHEDULE_STATS
+void gk_schedule_get_stats(gkScheduleStats *stats) {
+    SCHEDULE_LOCK();
+    *stats = sched.stats;
+    stats->overflows = sched.overflows;
+    SCHEDULE_UNLOCK();
+}
+
+void gk_schedule_reset_stats(void) {
+    SCHEDULE_LOCK();
+    sched.stats = (gkScheduleStats) {0};
+    sched.stats.peak_size = sched.length;
+    sched.overflows = 0;
+    sched.timing_loop = false;
+    SCHEDULE_UNLOCK();
+}
+#endif
+
+uint8_t gk_schedule_pin_size(gkPin pin) {
+    if (pin < GK_NUM_PINS)
+        return sched.pins[pin].count;
+    else
+        return 0;
+}
+
+bool gk_schedule_pin_last(gkPin pin, gkTime *time) {
+    if (pin >= GK_NUM_PINS)
+        return false;
+    bool pending = false;
+    SCHEDULE_LOCK();
+    PinEvents *pin_events = &sched.pins[pin];
+    if (pin_events->count) {
+        if (pin_events->stale) {
+            uint8_t node_ind = pin_events->head;
+            gkTime last_time = sched.nodes[node_ind].event.time;
+            while ((node_ind = sched.nodes[node_ind].pin_next) != NO_NODE) {
+                if (gk_time_after(sched.nodes[node_ind].event.time, last_time))
+                    last_time = sched.nodes[node_ind].event.time;
+            }
+            pin_events->last_time = last_time;
+            pin_events->stale = false;
+        }
+        *time = pin_events->last_time;
+        pending = true;
+    }
+    SCHEDULE_UNLOCK();
+    return pending;
+}
+
+uint8_t gk_schedule_cancel_pin(gkPin pin) {
+    if (pin >= GK_NUM_PINS)
+        return 0;
+    SCHEDULE_LOCK();
+    PinEvents *pin_events = &sched.pins[pin];
+    uint8_t cancelled = pin_events->count;
+    while (pin_events->count)
+        heap_discard(sched.nodes[pin_events->head].heap_pos);
+    SCHEDULE_UNLOCK();
+    return cancelled;
+}
+
+uint8_t gk_schedule_lock(void) {
+    uint8_t SREG_orig = SREG;
+#if GK_SCHEDULE_INTERRUPT
+    cli();
+#endif
+    return SREG_orig;
+}
+
+void gk_schedule_unlock(uint8_t SREG_orig) {
+#if GK_SCHEDULE_INTERRUPT
+    SREG = SREG_orig;
+#else
+    (void)SREG_orig;
+#endif
+}
+
 gkScheduleIterator gk_schedule_head() {
-    return sched.head;
+    if (sched.length)
+        return NODE_AT(0);
+    else
+        return 0;
 }
 
 gkScheduleIterator gk_schedule_tail() {
-    return sched.tail;
+    if (sched.length)
+        return NODE_AT(sched.length - 1);
+    else
+        return 0;
 }
 
 gkScheduleIterator gk_schedule_next(gkScheduleIterator iter) {
-    if (iter)
-        return iter->next;
+    if (iter && iter->heap_pos + 1 < sched.length)
+        return NODE_AT(iter->heap_pos + 1);
     else
         return 0;
 }
 
 gkScheduleIterator gk_schedule_prev(gkScheduleIterator iter) {
-    if (iter)
-        return iter->prev;
+    if (iter && iter->heap_pos)
+        return NODE_AT(iter->heap_pos - 1);
     else
         return 0;
 }
@@ -108,86 +617,289 @@ gkScheduledEvent *const gk_schedule_get(gkScheduleIterator iter) {
 void gk_schedule_remove(gkScheduleIterator iter) {
     if (!iter)
         return;
-    if (iter->prev) {
-        iter->prev->next = iter->next;
-    } else {
-        sched.head = iter->next;
+    SCHEDULE_LOCK();
+    if (iter->heap_pos < sched.length)
+        heap_discard(iter->heap_pos);
+    SCHEDULE_UNLOCK();
+}
+
+// Changes to make to a port's output register, as for gk_port_update
+typedef struct PortWrite {
+    uint8_t set_mask;
+    uint8_t clear_mask;
+    uint8_t toggle_mask;
+} PortWrite;
+
+// Fold a pin action into a port write that will follow any already in it,
+// swapping on and off for an inverted pin
+static inline void port_write_add(
+        PortWrite *write,
+        uint8_t bit,
+        gkPinAction action,
+        bool inverted) {
+    if (inverted) {
+        if (action == GK_PIN_WRITE_ON)
+            action = GK_PIN_WRITE_OFF;
+        else if (action == GK_PIN_WRITE_OFF)
+            action = GK_PIN_WRITE_ON;
     }
-    if (iter->next) {
-        iter->next->prev = iter->prev;
-    } else {
-        sched.tail = iter->prev;
+    switch (action) {
+    case GK_PIN_WRITE_ON:
+        write->set_mask |= bit;
+        write->clear_mask &= ~bit;
+        write->toggle_mask &= ~bit;
+        break;
+    case GK_PIN_WRITE_OFF:
+        write->clear_mask |= bit;
+        write->set_mask &= ~bit;
+        write->toggle_mask &= ~bit;
+        break;
+    case GK_PIN_WRITE_TOGGLE:
+        write->toggle_mask ^= bit;
+        break;
     }
-    free(iter);
 }
 
-void gk_schedule_execute() {
-    gkScheduleNode *current = sched.head;
-    while (current && current->event.time <= millis()) {
-        gk_pin_write(current->event.pin, current->event.action);
+#if GK_SCHEDULE_STATS
+static inline void stats_add(uint32_t *total, uint32_t value) {
+    *total = (*total > 0xFFFFFFFF - value) ? 0xFFFFFFFF : *total + value;
+}
 
-        sched.head = current->next;
-        --sched.length;
-        free(current);
-        current = sched.head;
+// Record that count events scheduled for time were executed at gk_time_fine()
+// reading now_fine
+static void stats_record_lateness(gkTime time, uint32_t now_fine,
+        uint8_t count) {
+    // gk_time_fine() wraps around along with time * GK_TIME_FINE_PER_UNIT
+    int32_t lateness = now_fine - time * GK_TIME_FINE_PER_UNIT;
+    if (lateness < 0)
+        lateness = 0;
+    uint8_t bucket = 0;
+    for (uint32_t rest = lateness; rest; rest >>= 1) {
+        if (++bucket == GK_SCHEDULE_LATENESS_BUCKETS - 1)
+            break;
     }
-    if (sched.head)
-        sched.head->prev = 0;
+    gkScheduleStats *stats = &sched.stats;
+    if (stats->lateness[bucket] <= 0xFFFF - count)
+        stats->lateness[bucket] += count;
     else
-        sched.tail = 0;
+        stats->lateness[bucket] = 0xFFFF;
+    stats_add(&stats->events, count);
+    stats_add(&stats->lateness_total,
+        ((uint32_t)lateness > 0xFFFFFFFF / count) ?
+            0xFFFFFFFF : (uint32_t)lateness * count);
+    if ((uint32_t)lateness > stats->lateness_max)
+        stats->lateness_max = lateness;
+}
+#endif
+
+// Perform and remove all events due by the current time
+static void schedule_run_due(void) {
+    gkTime now = gk_time_now();
+    PortWrite writes[GK_NUM_PORTS + 1];
+#if GK_SCHEDULE_STATS
+    uint32_t now_fine = 0;
+    bool have_fine = false;
+#endif
+    while (sched.length && !gk_time_before(now, NODE_AT(0)->event.time)) {
+        // Gather up all of the events due at this same time
+        gkTime time = NODE_AT(0)->event.time;
+        uint16_t ports_written = 0;
+#if GK_SCHEDULE_STATS
+        // Every event executed in this call is taken to be executed now
+        if (!have_fine) {
+            now_fine = gk_time_fine();
+            have_fine = true;
+        }
+        uint8_t count = 0;
+#endif
+        do {
+#if GK_SCHEDULE_STATS
+            ++count;
+#endif
+            gkScheduledEvent event = NODE_AT(0)->event;
+            uint8_t generator = NODE_AT(0)->generator;
+            heap_remove(0);
+            // If a generator's next edge is also due now (e.g., the end of a
+            // zero-width pulse), it is gathered up with the rest
+            if (generator)
+                generator_advance(generator, event.pin);
+            if (event.pin < GK_NUM_PINS
+                    && gk_pin_writes_simple(event.pin)) {
+                gkPort port = digitalPinToPort(event.pin);
+                if (!port || port > GK_NUM_PORTS)
+                    continue;
+                if (!(ports_written & (1 << port))) {
+                    writes[port] = (PortWrite) {0};
+                    ports_written |= 1 << port;
+                }
+                port_write_add(
+                    &writes[port],
+                    digitalPinToBitMask(event.pin),
+                    event.action,
+                    gk_pin_inverted(event.pin)
+                );
+            } else {
+                gk_pin_write(event.pin, event.action);
+            }
+        } while (sched.length && NODE_AT(0)->event.time == time);
+#if GK_SCHEDULE_STATS
+        stats_record_lateness(time, now_fine, count);
+#endif
+
+        for (gkPort port = 1; ports_written; ++port) {
+            if (ports_written & (1 << port)) {
+                gk_port_update(
+                    port,
+                    writes[port].set_mask,
+                    writes[port].clear_mask,
+                    writes[port].toggle_mask
+                );
+                ports_written &= ~(1 << port);
+            }
+        }
+    }
+}
+
+void gk_schedule_execute() {
+    SCHEDULE_LOCK();
+#if GK_SCHEDULE_STATS
+    uint32_t now_fine = gk_time_fine();
+    if (sched.timing_loop) {
+        uint32_t interval = now_fine - sched.last_execute;
+        if (sched.stats.loops < 0xFFFFFFFF)
+            ++sched.stats.loops;
+        stats_add(&sched.stats.loop_total, interval);
+        if (interval > sched.stats.loop_max)
+            sched.stats.loop_max = interval;
+    }
+    sched.last_execute = now_fine;
+    sched.timing_loop = true;
+#endif
+    schedule_run_due();
+#if GK_SCHEDULE_INTERRUPT
+    schedule_arm();
+#endif
+    SCHEDULE_UNLOCK();
 }
 
-void gk_schedule_write_byte(
+#if GK_SCHEDULE_INTERRUPT
+// Arm the timer interrupt for the next event due, or disarm it if there are
+// none. Must be called with interrupts disabled.
+static void schedule_arm(void) {
+    if (!sched.length) {
+        TIMSK1 &= ~_BV(OCIE1B);
+        return;
+    }
+#if GK_TIME_BASE == GK_TIME_TICK
+    if (!(TIMSK1 & _BV(OCIE1B))) {
+        TIFR1 = _BV(OCF1B);
+        TIMSK1 |= _BV(OCIE1B);
+    }
+#else
+    gkTime now = gk_time_now();
+    gkTime due = NODE_AT(0)->event.time;
+    uint16_t counts = SCHEDULE_TIMER_POLL_COUNTS;
+    if (gk_time_before(now + SCHEDULE_TIMER_EARLY, due)) {
+        gkTime wait = due - now - SCHEDULE_TIMER_EARLY;
+        if (wait > SCHEDULE_TIMER_MAX_WAIT)
+            wait = SCHEDULE_TIMER_MAX_WAIT;
+        counts = SCHEDULE_TIMER_COUNTS(wait);
+        if (SCHEDULE_TIMER_EARLY)
+            counts += SCHEDULE_TIMER_POLL_COUNTS;
+    }
+    OCR1B = TCNT1 + counts;
+    TIFR1 = _BV(OCF1B);
+    TIMSK1 |= _BV(OCIE1B);
+#endif
+}
+
+ISR(TIMER1_COMPB_vect) {
+    schedule_run_due();
+    schedule_arm();
+}
+#endif
+
+uint8_t gk_schedule_write_byte(
         gkTime when,
         gkPin pin,
         gkTime bit_interval,
         gkTime bit_width,
         uint8_t value) {
-    gk_schedule_write_bytes(when, pin, bit_interval, bit_width, 1, &value);
+    return gk_schedule_write_bytes(
+        when, pin, bit_interval, bit_width, 1, &value);
 }
 
-//void gk_schedule_write_bytes(
-//        gkTime when,
-//        gkPin pin,
-//        gkTime bit_interval,
-//        gkTime bit_width,
-//        uint8_t count,
-//        uint8_t* value ) {
-//    gk_schedule_write_bytes_with_checksum(
-//        when, pin, bit_interval, bit_width, count, value, /* generic checksum?*/
-//}
-
 // Write a series of bits to communicate information, using a simplistic
 // protocol. Each bit consists of either a 1 waveform (bit_width ms ON
 // followed by bit_interval-bit_width ms OFF) or a 0 waveform (bit_interval ms
 // OFF). Here, ON is defined as departing from the intially set value, OFF as
 // remaining unchanged. The sequence of bits is preceded and followed by a 1
-// waveform.
-void gk_schedule_write_bytes(
+// waveform. The bits are produced by a generator, one edge at a time, so the
+// whole write takes only one event in the schedule.
+static uint8_t schedule_write_bytes(
         gkTime when,
         gkPin pin,
         gkTime bit_interval,
         gkTime bit_width,
         uint8_t count,
-        uint8_t* value ) {
-    if (!when) {
-        // Immediate write
-        gk_pin_write(pin, GK_PIN_WRITE_TOGGLE);
-        when = millis();
-    } else {
-        gk_schedule_add(when, pin, GK_PIN_WRITE_TOGGLE);
-    }
-    gk_schedule_add(when+bit_width, pin, GK_PIN_WRITE_TOGGLE);
-    when += bit_interval;
-    for (uint8_t byte_ind=0; byte_ind < count; byte_ind++) {
-        for (uint8_t bit_ind=0; bit_ind<8; bit_ind++) {
-            if ( *(value+byte_ind) & (1 << bit_ind) ) {
-                gk_schedule_add(when, pin, GK_PIN_WRITE_TOGGLE);
-                gk_schedule_add(when+bit_width, pin, GK_PIN_WRITE_TOGGLE);
-            }
-            when += bit_interval;
+        uint8_t* value,
+        bool checksum) {
+    if (count > GK_SCHEDULE_WRITE_MAX)
+        return GK_SCHEDULE_FULL;
+    bool immediate = !when;
+    if (immediate)
+        when = gk_time_now();
+    uint8_t length;
+    SCHEDULE_LOCK();
+    // For an immediate write, the leading 1-waveform begins right away, so
+    // the first edge to schedule is its end
+    Generator *gen = generator_start(
+        GENERATOR_BYTES,
+        immediate ? when + bit_width : when,
+        pin,
+        GK_PIN_WRITE_TOGGLE,
+        &length);
+    if (gen) {
+        gen->in_pulse = immediate;
+        gen->pulse_start = when;
+        gen->width = bit_width;
+        gen->bytes.bit_interval = bit_interval;
+        gen->bytes.bit = 0;
+        gen->bytes.num_bits = 8 * count + 2;
+        uint8_t crc = 0;
+        for (uint8_t byte_ind = 0; byte_ind < count; ++byte_ind) {
+            gen->bytes.data[byte_ind] = value[byte_ind];
+            gk_crc8_update(&crc, value[byte_ind]);
         }
+        if (checksum) {
+            gen->bytes.data[count] = crc;
+            gen->bytes.num_bits += 8;
+        }
+        if (immediate)
+            gk_pin_write(pin, GK_PIN_WRITE_TOGGLE);
     }
-    gk_schedule_add(when, pin, GK_PIN_WRITE_TOGGLE);
-    gk_schedule_add(when+bit_width, pin, GK_PIN_WRITE_TOGGLE);
+    SCHEDULE_UNLOCK();
+    return length;
+}
+
+uint8_t gk_schedule_write_bytes(
+        gkTime when,
+        gkPin pin,
+        gkTime bit_interval,
+        gkTime bit_width,
+        uint8_t count,
+        uint8_t* value) {
+    return schedule_write_bytes(
+        when, pin, bit_interval, bit_width, count, value, false);
+}
+
+uint8_t gk_schedule_write_bytes_with_checksum(
+        gkTime when,
+        gkPin pin,
+        gkTime bit_interval,
+        gkTime bit_width,
+        uint8_t count,
+        uint8_t* value) {
+    return schedule_write_bytes(
+        when, pin, bit_interval, bit_width, count, value, true);
 }
@@ -1,5 +1,6 @@
 /* schedule.h
-Allow digital outputs to be "scheduled" to a millisecond-precision clock.
+Allow digital outputs to be "scheduled" to a millisecond- (or microsecond-)
+precision clock; see GK_TIME_BASE in gkutil.h.
 */
 
 #ifndef SCHEDULE_H
@@ -10,8 +11,69 @@ Allow digital outputs to be "scheduled" to a millisecond-precision clock.
 extern "C" {
 #endif
 
-// Maximum number of scheduled digital output events to queue
-#define SCHEDULE_BUFFER_SIZE 256
+// Maximum number of scheduled digital output events to queue. All storage for
+// the schedule is allocated statically, so this directly sets how much SRAM
+// the schedule uses (about 12 bytes per event). Override with a compiler flag
+// if desired; it must be no more than 255.
+#ifndef SCHEDULE_BUFFER_SIZE
+#if RAMEND > 0x1000
+#define SCHEDULE_BUFFER_SIZE 255
+#else
+#define SCHEDULE_BUFFER_SIZE 70
+#endif
+#endif
+
+#if SCHEDULE_BUFFER_SIZE > 255
+#error SCHEDULE_BUFFER_SIZE must be no more than 255
+#endif
+
+// Number of generated waveforms (see gk_schedule_pulse_train) that can run at
+// once, each taking about 24 bytes of SRAM. Override with a compiler flag if
+// desired; it must be no more than 254.
+#ifndef SCHEDULE_GENERATORS
+#if RAMEND > 0x1000
+#define SCHEDULE_GENERATORS 28
+#else
+#define SCHEDULE_GENERATORS 4
+#endif
+#endif
+
+// Define GK_SCHEDULE_INTERRUPT as 1 (e.g., with a compiler flag) to perform
+// scheduled writes from a Timer1 compare-match interrupt, armed for the next
+// event due, rather than only when gk_schedule_execute is called. Output
+// timing is then independent of how busy the main loop is. This takes over
+// Timer1, so PWM on its pins (and libraries like Servo) can't be used. With
+// the GK_TIME_TICK time base, the interrupt instead follows each tick while
+// any events are pending.
+#ifndef GK_SCHEDULE_INTERRUPT
+#define GK_SCHEDULE_INTERRUPT 0
+#endif
+
+// Most bytes that gk_schedule_write_bytes can send in one write. Each
+// generator reserves room for this many (plus a checksum). Override with a
+// compiler flag if desired; it must be no more than 30.
+#ifndef GK_SCHEDULE_WRITE_MAX
+#define GK_SCHEDULE_WRITE_MAX 8
+#endif
+
+#if GK_SCHEDULE_WRITE_MAX > 30
+#error GK_SCHEDULE_WRITE_MAX must be no more than 30
+#endif
+
+// Define GK_SCHEDULE_STATS as 0 (e.g., with a compiler flag) to leave out the
+// timing statistics (see gk_schedule_get_stats), which take about 65 bytes of
+// SRAM and a gk_time_fine() reading on each call to gk_schedule_execute and
+// each batch of events executed.
+#ifndef GK_SCHEDULE_STATS
+#define GK_SCHEDULE_STATS 1
+#endif
+
+// Number of buckets in the histogram of how late events were executed
+#define GK_SCHEDULE_LATENESS_BUCKETS 16
+
+// Returned by gk_schedule_add (and friends) when the schedule has no room for
+// the requested events. Nothing is scheduled in that case.
+#define GK_SCHEDULE_FULL 0
 
 #ifdef SCHEDULE_GLOBAL
 #define EXTERN
@@ -27,32 +89,131 @@ typedef struct gkScheduledEvent {
 
 typedef struct gkScheduleNode *gkScheduleIterator;
 
-// Schedule a digital write action to be executed when millis()>=time.
-// Returns the (current) index of the scheduled event, but note that this may
-// change after calling gk_schedule_execute
+#if GK_SCHEDULE_STATS
+// Statistics gathered since startup or the last gk_schedule_reset_stats. All
+// durations are in gk_time_fine() units, and all counts stop at their maximum
+// rather than wrapping around.
+typedef struct gkScheduleStats {
+    // Number of events executed, and the total and greatest time by which
+    // they were late (the time they were executed, minus the time they were
+    // scheduled for)
+    uint32_t events;
+    uint32_t lateness_total;
+    uint32_t lateness_max;
+    // Histogram of lateness: bucket 0 counts events less than 1 unit late,
+    // and bucket k counts those from 2^(k-1) to 2^k - 1 units late, except
+    // that the last bucket counts everything later still
+    uint16_t lateness[GK_SCHEDULE_LATENESS_BUCKETS];
+    // Number of intervals between calls to gk_schedule_execute (e.g., main
+    // loop iterations), and their total and greatest length
+    uint32_t loops;
+    uint32_t loop_total;
+    uint32_t loop_max;
+    // Greatest number of events in the schedule at once
+    uint8_t peak_size;
+    // Events rejected because the schedule was full, as gk_schedule_overflows
+    uint16_t overflows;
+} gkScheduleStats;
+#endif
+
+// Set up the schedule. Call once during setup(), after gk_setup().
+void gk_schedule_setup(void);
+// Schedule a digital write action to be executed when gk_time_now()>=time.
+// Events with equal times are executed in the order they were added. The time
+// must be within 2^31 units of the current time.
+// Returns the number of events now in the schedule, or GK_SCHEDULE_FULL if
+// there was no room for the event.
 uint8_t gk_schedule_add(gkTime time, gkPin pin, gkPinAction action);
+// Schedule a train of pulses on a pin that is generated one edge at a time,
+// so that it takes up only one event in the schedule however long it is. The
+// first pulse begins at start; each pulse begins with on_action and ends with
+// off_action width later, and the next begins period after the last began,
+// plus a random extra delay from 0 to jitter (see gk_schedule_seed; jitter
+// is limited to 2^31 - 1). width must be less than period, and is shortened
+// to period - 1 if it isn't (unless count is 1). count pulses are generated,
+// or if count is 0, pulses repeat until cancelled (e.g., with
+// gk_schedule_cancel_pin). Only the next edge of the train counts as
+// scheduled on the pin.
+// Returns the number of events now in the schedule, or GK_SCHEDULE_FULL if
+// there was no room for the event or no free generator (in which case it
+// counts as an overflow).
+uint8_t gk_schedule_pulse_train(
+    gkTime start,
+    gkPin pin,
+    gkPinAction on_action,
+    gkPinAction off_action,
+    gkTime period,
+    gkTime width,
+    uint16_t count,
+    gkTime jitter
+);
+// Get the number of generated waveforms that can be started before all of the
+// generators (SCHEDULE_GENERATORS) are in use
+uint8_t gk_schedule_generators_available(void);
+// Seed the random number generator used for jitter. The sequence of random
+// delays is the same after each seeding with the same value.
+void gk_schedule_seed(uint32_t seed);
 // Get the number of actions currently scheduled
 uint8_t gk_schedule_size();
-// Get the n'th event scheduled
-//gkScheduledEvent*const gk_schedule_get(uint8_t n);
-// Remove the n'th event scheduled
+// Get the number of events that can be added before the schedule is full
+uint8_t gk_schedule_available();
+// Get the number of events rejected because the schedule was full, since
+// startup or the last call to gk_schedule_clear_overflows
+uint16_t gk_schedule_overflows();
+void gk_schedule_clear_overflows();
+#if GK_SCHEDULE_STATS
+// Copy the current statistics into *stats
+void gk_schedule_get_stats(gkScheduleStats *stats);
+// Start gathering statistics afresh, also clearing the overflow count
+void gk_schedule_reset_stats(void);
+#endif
+// Get the number of events currently scheduled on a pin
+uint8_t gk_schedule_pin_size(gkPin pin);
+// If any events are scheduled on a pin, store the latest of their times in
+// *time and return true; otherwise return false
+bool gk_schedule_pin_last(gkPin pin, gkTime *time);
+// Remove all events scheduled on a pin, returning how many were removed. The
+// pin is left in whatever state it is currently in.
+uint8_t gk_schedule_cancel_pin(gkPin pin);
+// Iterate through the scheduled events. The head is always the next event
+// due, but the remaining events are visited in no particular time order.
+// Removing an event invalidates all iterators. In interrupt mode, events may
+// be executed (and removed) at any time, so iterate only between
+// gk_schedule_lock and gk_schedule_unlock.
+uint8_t gk_schedule_lock(void);
+void gk_schedule_unlock(uint8_t);
 gkScheduleIterator gk_schedule_head();
 gkScheduleIterator gk_schedule_tail();
 gkScheduleIterator gk_schedule_next(gkScheduleIterator);
 gkScheduleIterator gk_schedule_prev(gkScheduleIterator);
 gkScheduledEvent *const gk_schedule_get(gkScheduleIterator);
 void gk_schedule_remove(gkScheduleIterator);
-// Check the schedule and perform any write actions that are due
+// Check the schedule and perform any write actions that are due. Not needed
+// in interrupt mode, but harmless.
 void gk_schedule_execute();
-// Perform a low-bitrate serial write, to begin when millis()>=time
-void gk_schedule_write_byte(
+// Perform a low-bitrate serial write, to begin when gk_time_now()>=time, or
+// immediately if time is 0. The write is generated one edge at a time, taking
+// one event in the schedule and one generator. Returns the number of events
+// now in the schedule, or GK_SCHEDULE_FULL if there was no room, or if count
+// is more than GK_SCHEDULE_WRITE_MAX (in which case none of it is
+// scheduled). The bytes are copied, so value need not outlive the call.
+uint8_t gk_schedule_write_byte(
     gkTime time,
     gkPin pin,
     gkTime bit_interval,
     gkTime bit_width,
     uint8_t value
 );
-void gk_schedule_write_bytes(
+uint8_t gk_schedule_write_bytes(
+    gkTime time,
+    gkPin pin,
+    gkTime bit_interval,
+    gkTime bit_width,
+    uint8_t count,
+    uint8_t* value);
+// As gk_schedule_write_bytes, followed by one more byte: the CRC8 of the
+// others, as computed by gk_crc8_update starting from 0
+uint8_t gk_schedule_write_bytes_with_checksum(
     gkTime time,
     gkPin pin,
     gkTime bit_interval,
@@ -63,4 +224,5 @@ void gk_schedule_write_bytes(
 #ifdef __cplusplus
 }
 #endif
+#undef EXTERN
 #endif